@@ -1,68 +1,104 @@
 #!/usr/bin/python3
 
+import os
 import subprocess
 import sys
+import tempfile
 
 from itertools import product
 
-def build_program(best_fit_search_limit,
-                  mini_block_optimization,
-                  free_list_insert_strategy,
-                  free_table_size,
-                  binning_strategy,
-                  run_name):
+CC = "gcc"
+FLAGS = "-std=gnu11 -pthread"
+FLAGS += " -Wall -Wextra -Wpedantic -Werror"
+FLAGS += " -Wdouble-promotion -Wno-type-limits -Wno-unused-variable -Wno-unused-parameter -Wno-unused-function"
+
+RELEASE_FLAGS = "-O3 -DNDEBUG"
+
+SRC = [
+    "main.c",
+    "trace.c",
+    "trace_parser.c",
+    "heapsim.c",
+    "perf.c",
+    "vec_u64.c",
+    "string.c",
+    "csv.c",
+]
+
+LIBS = ["-lm"]
+
+variants = []
+
+# Add an allocator variant named run_name, main writes its statistics to
+# run_name.csv.
+def add_variant(best_fit_search_limit,
+                mini_block_optimization,
+                free_list_insert_strategy,
+                free_table_size,
+                binning_strategy,
+                run_name,
+                large_bin_tree=False):
 
     if mini_block_optimization:
         mini_block_optimization = "TRUE"
     else:
         mini_block_optimization = "FALSE"
 
-    CC = "gcc"
-    FLAGS = "-std=gnu11 -lm"
-    FLAGS += " -Wall -Wextra -Wpedantic -Werror"
-    FLAGS += " -Wdouble-promotion -Wno-type-limits -Wno-unused-variable -Wno-unused-parameter -Wno-unused-function"
+    # the last bin ignores the search limit when it is a tree, so it is
+    # always given rather than left to config.h
+    if large_bin_tree:
+        large_bin_tree = "TRUE"
+    else:
+        large_bin_tree = "FALSE"
+
+    flags = []
 
     # integer
-    FLAGS += f" -DBEST_FIT_SEARCH_LIMIT={best_fit_search_limit}"
+    flags += [f"-DBEST_FIT_SEARCH_LIMIT={best_fit_search_limit}"]
 
     # TRUE, FALSE
-    FLAGS += f" -DMINI_BLOCK_OPTIMIZATION={mini_block_optimization}"
+    flags += [f"-DMINI_BLOCK_OPTIMIZATION={mini_block_optimization}"]
 
     # ADDRESS_ORDERED, FILO
-    FLAGS += f" -DFREE_LIST_INSERT_STRATEGY={free_list_insert_strategy}"
+    flags += [f"-DFREE_LIST_INSERT_STRATEGY={free_list_insert_strategy}"]
 
     # integet
-    FLAGS += f" -DFREE_TABLE_SIZE={free_table_size}"
+    flags += [f"-DFREE_TABLE_SIZE={free_table_size}"]
 
     # Linear_Binning, Exponential_Binning, Hybrid_Binning, Range_Binning
-    FLAGS += f" -DSize_Get_Bin_Index={binning_strategy}"
-
-    FLAGS += f' -DRUN_NAME="{run_name}"'
-
-    RELEASE_FLAGS = "-O3 -DNDEBUG"
-
-    SRC = [
-        "main.c",
-        "trace.c",
-        "trace_parser.c",
-        "mm.c",
-        "heapsim.c",
-        "perf.c",
-        "vec_u64.c",
-        "string.c",
-        "csv.c",
-    ]
-
-    build_flags = f"{FLAGS} {RELEASE_FLAGS}"
+    flags += [f"-DSize_Get_Bin_Index={binning_strategy}"]
 
-    command = [CC] + build_flags.split() + SRC + ["-o", "main"]
-
-    try:
-        print(command);
-        subprocess.run(command, check=True)
-    except subprocess.CalledProcessError as e:
-        print("build failed...")
-        sys.exit(1)
+    # TRUE, FALSE
+    flags += [f"-DLARGE_BIN_TREE={large_bin_tree}"]
+
+    variants.append((run_name, flags))
+
+# Compile every variant into one binary and run it once, each trace is parsed
+# once and replayed against all of them.
+def build_and_run():
+    build_flags = f"{FLAGS} {RELEASE_FLAGS}".split()
+
+    with tempfile.TemporaryDirectory() as obj_dir:
+        objs = []
+        for run_name, flags in variants:
+            obj = os.path.join(obj_dir, f"mm_{run_name}.o")
+            command = [CC] + build_flags + [f"-DMM_VARIANT={run_name}"] + flags + ["-c", "mm.c", "-o", obj]
+            try:
+                print(command);
+                subprocess.run(command, check=True)
+            except subprocess.CalledProcessError as e:
+                print("build failed...")
+                sys.exit(1)
+            objs.append(obj)
+
+        mm_variants = " ".join(f"VARIANT({run_name})" for run_name, _ in variants)
+        command = [CC] + build_flags + [f"-DMM_VARIANTS={mm_variants}"] + SRC + objs + LIBS + ["-o", "main"]
+        try:
+            print(command);
+            subprocess.run(command, check=True)
+        except subprocess.CalledProcessError as e:
+            print("build failed...")
+            sys.exit(1)
 
     try:
         print("./main");
@@ -75,25 +111,27 @@ def build_program(best_fit_search_limit,
 # --- effect of binning strategies...
 
 # for b in ["Linear_Binning", "Exponential_Binning", "Hybrid_Binning", "Range_Binning"]:
-#     build_program(0x10, True, "FILO", 0x10, b, b)
+#     add_variant(0x10, True, "FILO", 0x10, b, b)
 
 # --- mini block optimization...
 
-# build_program(0x10, True, "FILO", 0x1, "Linear_Binning", "Mini_Block_No_Binning")
-# build_program(0x10, True, "FILO", 0x10, "Linear_Binning", "Mini_Block_With_Binning")
+# add_variant(0x10, True, "FILO", 0x1, "Linear_Binning", "Mini_Block_No_Binning")
+# add_variant(0x10, True, "FILO", 0x10, "Linear_Binning", "Mini_Block_With_Binning")
 
-# build_program(0x10, False, "FILO", 0x1, "Linear_Binning", "No_Mini_Block_No_Binning")
-# build_program(0x10, False, "FILO", 0x10, "Linear_Binning", "No_Mini_Block_With_Binning")
+# add_variant(0x10, False, "FILO", 0x1, "Linear_Binning", "No_Mini_Block_No_Binning")
+# add_variant(0x10, False, "FILO", 0x10, "Linear_Binning", "No_Mini_Block_With_Binning")
 
 # --- search strategies...
 
 # for search_limit in [0x1, 0x8, 0x10, 0x18, 0x20, 0x28, 0x30]:
-#     build_program(search_limit, True, "FILO", 0x10, "Linear_Binning", f"Search_Limit_{search_limit}")
+#     add_variant(search_limit, True, "FILO", 0x10, "Linear_Binning", f"Search_Limit_{search_limit}")
 
 # --- LL ordering...
-# build_program(0x10, True, "FILO", 0x10, "Linear_Binning", "FILO_Insertion")
-# build_program(0x10, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_1")
-# build_program(0x20, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_2")
-# build_program(0x30, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_3")
-# build_program(0x40, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_4")
-# build_program(0x50, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_5")
+# add_variant(0x10, True, "FILO", 0x10, "Linear_Binning", "FILO_Insertion")
+# add_variant(0x10, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_1")
+# add_variant(0x20, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_2")
+# add_variant(0x30, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_3")
+# add_variant(0x40, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_4")
+# add_variant(0x50, True, "ADDRESS_ORDERED", 0x10, "Linear_Binning", "Address_Ordered_Insertion_5")
+
+# build_and_run()
@@ -1,10 +1,10 @@
-#!/bin/sh
+#!/bin/bash
 
 set -xe
 
 CC="gcc"
 
-FLAGS="-std=gnu11 -lm"
+FLAGS="-std=gnu11 -pthread"
 FLAGS+=" -Wall -Wextra -Wpedantic -Werror"
 FLAGS+=" -Wdouble-promotion -Wno-unused-variable -Wno-unused-parameter -Wno-unused-function"
 
@@ -15,18 +15,77 @@ RELEASE_FLAGS="-O3 -DNDEBUG"
 SRC="main.c"
 SRC+=" trace.c"
 SRC+=" trace_parser.c"
-SRC+=" mm.c"
 SRC+=" heapsim.c"
 SRC+=" perf.c"
 SRC+=" vec_u64.c"
 SRC+=" string.c"
 SRC+=" csv.c"
 
+LIBS="-lm"
+
+# libmm.so replaces the malloc family of the C library in programs run with
+# LD_PRELOAD=./libmm.so, any other arguments are -D flags for config.h.
+# Unlike Control, it gives memory back to the OS and maps big requests on
+# their own, which long running programs need.
+PRELOAD_FLAGS="-fPIC -shared -fvisibility=hidden -ftls-model=initial-exec -DARENA_COUNT=8"
+PRELOAD_FLAGS+=" -DTRIM_THRESHOLD=0x20000 -DMMAP_THRESHOLD=0x20000"
+# the arenas grow the heap by 64 KiB at least, so they don't take its lock for
+# every page...
+PRELOAD_FLAGS+=" -DHEAP_GROWTH_MIN_SIZE=0x10000"
+
+PRELOAD_SRC="libmm.c"
+PRELOAD_SRC+=" mm.c"
+PRELOAD_SRC+=" heapsim.c"
+
+if [ "$1" = "preload" ]; then
+    $CC $FLAGS $RELEASE_FLAGS $PRELOAD_FLAGS "${@:2}" $PRELOAD_SRC -o libmm.so
+    exit 0
+fi
+
 if [ "$1" = "debug" ]; then
-    $CC $FLAGS $DEV_FLAGS $SRC -o main
+    BUILD_FLAGS="$DEV_FLAGS"
 elif [ "$1" = "release" ]; then
-    $CC $FLAGS $RELEASE_FLAGS $SRC -o main
+    BUILD_FLAGS="$RELEASE_FLAGS"
 else
     echo "Unknown build type"
     exit 1
 fi
+
+# any other arguments are -D flags for every file, e.g. to pick the pages of
+# the simulated heap with -DHEAP_SIM_PAGES=TRANSPARENT_HUGE_PAGES
+BUILD_FLAGS+=" ${*:2}"
+
+OBJ_DIR=$(mktemp -d)
+trap 'rm -rf "$OBJ_DIR"' EXIT
+
+OBJS=""
+VARIANTS=""
+
+# Compile mm.c into an allocator variant, the first argument is its name and
+# the rest are -D flags overriding the options in config.h. Every trace is run
+# against every variant and each writes its statistics to <name>.csv. Names
+# can't be macros of mm.h, like TLSF.
+variant() {
+    NAME=$1
+    shift
+    $CC $FLAGS $BUILD_FLAGS -DMM_VARIANT=$NAME "$@" -c mm.c -o "$OBJ_DIR/mm_$NAME.o"
+    OBJS+=" $OBJ_DIR/mm_$NAME.o"
+    VARIANTS+=" VARIANT($NAME)"
+}
+
+variant Control
+variant Address_Ordered -DFREE_LIST_INSERT_STRATEGY=ADDRESS_ORDERED
+variant TLSF_Index -DFREE_BLOCK_INDEX=TLSF
+variant Large_Bin_Tree -DLARGE_BIN_TREE=TRUE
+variant Amortized_Growth -DHEAP_GROWTH_MIN_SIZE=0x10000 -DHEAP_GROWTH_ALIGNMENT=0x1000
+variant Fast_Bins -DFAST_BIN_MAX_SIZE=0x80
+variant Trim -DTRIM_THRESHOLD=0x20000
+variant Mmap -DMMAP_THRESHOLD=0x20000
+# the heap of compact metadata stops at 4 GiB, the requests of
+# syn-largemem-short beyond that need mappings of their own
+variant Compact_Metadata -DCOMPACT_METADATA=TRUE -DMMAP_THRESHOLD=0x20000
+variant Alloc_Bitmap -DALLOC_BITMAP=TRUE
+variant Arenas -DARENA_COUNT=4
+variant Slab -DSLAB_MAX_SIZE=0x80
+
+$CC $FLAGS $BUILD_FLAGS "-DMM_VARIANTS=$VARIANTS" $SRC $OBJS $LIBS -o main
@@ -18,24 +18,131 @@
 
 #include "mm.h"
 
+// Every option can be overridden with -D, which is how build.sh and build.py
+// compile the same allocator into several variants.
+
 // possible values: integer, 0 = first-fit
+#ifndef BEST_FIT_SEARCH_LIMIT
 #define BEST_FIT_SEARCH_LIMIT 0x10
+#endif
 
 // possible values: TRUE, FALSE
+#ifndef MINI_BLOCK_OPTIMIZATION
 #define MINI_BLOCK_OPTIMIZATION TRUE
+#endif
+
+// possible values: TRUE, FALSE
+// tags are 32 bits and free list links are 32 bit offsets, which lets a block
+// hold 4 more bytes of payload and a free block need one word less, but caps
+// the heap at 4 GiB
+#ifndef COMPACT_METADATA
+#define COMPACT_METADATA FALSE
+#endif
+
+// possible values: TRUE, FALSE
+// prev_alloc and prev_min of every block are kept in a table beside the heap
+// rather than in its header, so allocating or freeing a block doesn't write
+// into the block after it
+#ifndef ALLOC_BITMAP
+#define ALLOC_BITMAP FALSE
+#endif
 
 // possible values: ADDRESS_ORDERED, FILO
+// ADDRESS_ORDERED keeps every free list in a tree sorted by address so the
+// lowest block that fits is found first; FILO pushes freed blocks to the front
+#ifndef FREE_LIST_INSERT_STRATEGY
 #define FREE_LIST_INSERT_STRATEGY FILO
+#endif
 
 // define a free table size and then define the binning strategy in
 // Size_Get_Bin_Index(...)
+#ifndef FREE_TABLE_SIZE
 #define FREE_TABLE_SIZE 0x10
+#endif
 
 // The function takes block_size and returns index of the free list bin it
 // should be in.
 // Possible values: Linear_Binning, Exponential_Binning, Hybrid_Binning,
 // Range_Binning, and you can also define your own function
+#ifndef Size_Get_Bin_Index
 #define Size_Get_Bin_Index Linear_Binning
+#endif
+
+// possible values: TRUE, FALSE
+// the last free list, which holds all the largest blocks, is kept in a tree
+// sorted by size that gives the best fit in logarithmic time instead of being
+// searched up to BEST_FIT_SEARCH_LIMIT blocks
+#ifndef LARGE_BIN_TREE
+#define LARGE_BIN_TREE FALSE
+#endif
+
+// possible values: SEGREGATED, TLSF
+// SEGREGATED searches the FREE_TABLE_SIZE lists binned by Size_Get_Bin_Index;
+// TLSF uses its own two-level size classes with occupancy bitmaps to find a
+// good fit in constant time, and ignores BEST_FIT_SEARCH_LIMIT,
+// FREE_TABLE_SIZE, Size_Get_Bin_Index and LARGE_BIN_TREE
+#ifndef FREE_BLOCK_INDEX
+#define FREE_BLOCK_INDEX SEGREGATED
+#endif
+
+// number of arenas, threads are bound to arenas round-robin and each arena has
+// its own free table, lock and chunks of the heap; 1 = a single arena without
+// any locking, which is not thread-safe
+#ifndef ARENA_COUNT
+#define ARENA_COUNT 1
+#endif
+
+// possible values: TRUE, FALSE
+// with multiple arenas, blocks freed by a thread not bound to the owning arena
+// are pushed onto a lock-free queue that the arena drains on its next malloc
+// or free
+#ifndef REMOTE_FREE_QUEUE
+#define REMOTE_FREE_QUEUE TRUE
+#endif
+
+// requests of up to this many bytes are served from slabs, pages of the heap
+// split into objects of one size class without headers; 0 = no slabs,
+// possible values: multiple of 16 between 0 and 1024
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 0
+#endif
+
+// freed blocks of up to this many bytes stay allocated on a list per size
+// that malloc takes them back from, they are coalesced in a batch later;
+// 0 = no fast bins, possible values: multiple of 16 between 0 and 1024
+#ifndef FAST_BIN_MAX_SIZE
+#define FAST_BIN_MAX_SIZE 0
+#endif
+
+// the heap is raised by at least this many bytes at a time, what the request
+// doesn't use stays free at the end of the heap for the next ones; 0 = by
+// exactly what the request needs
+#ifndef HEAP_GROWTH_MIN_SIZE
+#define HEAP_GROWTH_MIN_SIZE 0
+#endif
+
+// the heap is raised by at least this percentage of its size, so it grows
+// geometrically; 0 = no geometric growth
+#ifndef HEAP_GROWTH_PERCENT
+#define HEAP_GROWTH_PERCENT 0
+#endif
+
+// the end of the heap is rounded up to a multiple of this many bytes every
+// time it is raised, e.g. 0x1000 for pages or 0x200000 for huge pages,
+// possible values: power of two of at least 16
+#ifndef HEAP_GROWTH_ALIGNMENT
+#define HEAP_GROWTH_ALIGNMENT 0x10
+#endif
+
+// free blocks of at least this many bytes are given back to the OS, the heap
+// is lowered when they are at its end, otherwise the pages inside them are
+// discarded; 0 = never give memory back
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD 0
+#endif
 
-// name of the CSV file where statistics will be dumped
-#define RUN_NAME "output"
+// requests of at least this many bytes get a mapping of their own outside the
+// heap that is unmapped as soon as they are freed; 0 = everything in the heap
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD 0
+#endif
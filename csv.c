@@ -20,6 +20,15 @@
 #include "defines.h"
 #include <stdio.h>
 
+// what goes between columns, set once before any file is written...
+static const Char8 *separator = ", ";
+
+void
+CSV_Set_Separator(const Char8 *sep)
+{
+    separator = sep;
+}
+
 FILE *
 CSV_Open(const Char8 *filename)
 {
@@ -28,23 +37,57 @@ CSV_Open(const Char8 *filename)
 }
 
 void
-CSV_Write_Header(FILE *f)
+CSV_Write_Header(FILE *f, const Char8 *const *counters, size_t num_counters)
+{
+    static const Char8 *const ops[] = { "malloc", "calloc", "realloc", "free", "malloc batch", "free batch", "total" };
+    static const Char8 *const stats[] = {
+        "util", "reclaimed", "sbrk calls", "heap grows", "page faults", "dTLB misses",
+    };
+
+    fprintf(f, "trace");
+    for (size_t i = 0; i < num_counters; i += 1)
+    {
+        for (size_t j = 0; j < sizeof(ops) / sizeof(*ops); j += 1)
+        {
+            fprintf(f, "%s%s %s mean%s%s %s MOE", separator, counters[i], ops[j], separator, counters[i], ops[j]);
+        }
+    }
+    for (size_t j = 0; j < sizeof(stats) / sizeof(*stats); j += 1)
+    {
+        fprintf(f, "%s%s", separator, stats[j]);
+    }
+    fprintf(f, "\n");
+}
+
+void
+CSV_Write_Trace(FILE *f, const Char8 *trace)
+{
+    fprintf(f, "%s", trace);
+}
+
+void
+CSV_Write_Costs(FILE *f, F64 malloc, F64 malloc_moe, F64 calloc, F64 calloc_moe, F64 realloc, F64 realloc_moe,
+                F64 free, F64 free_moe, F64 malloc_batch, F64 malloc_batch_moe, F64 free_batch, F64 free_batch_moe,
+                F64 total, F64 total_moe)
 {
-    fprintf(
-        f,
-        "trace, malloc mean, malloc MOE, realloc mean, realloc MOE, free mean, free MOE, total mean, total MOE, util\n");
+    const Char8 *s = separator;
+    fprintf(f, "%s%f%s%f", s, malloc, s, malloc_moe);
+    fprintf(f, "%s%f%s%f", s, calloc, s, calloc_moe);
+    fprintf(f, "%s%f%s%f", s, realloc, s, realloc_moe);
+    fprintf(f, "%s%f%s%f", s, free, s, free_moe);
+    fprintf(f, "%s%f%s%f", s, malloc_batch, s, malloc_batch_moe);
+    fprintf(f, "%s%f%s%f", s, free_batch, s, free_batch_moe);
+    fprintf(f, "%s%f%s%f", s, total, s, total_moe);
 }
 
 void
-CSV_Write(FILE *f, const Char8 *trace, F64 malloc, F64 malloc_moe, F64 realloc, F64 realloc_moe, F64 free, F64 free_moe,
-          F64 total, F64 total_moe, F64 util)
+CSV_Write_Stats(FILE *f, F64 util, U64 reclaimed, U64 sbrk_calls, U64 heap_grows, U64 page_faults, U64 tlb_misses)
 {
-    fprintf(f, "%s, ", trace);
-    fprintf(f, "%f, %f, ", malloc, malloc_moe);
-    fprintf(f, "%f, %f, ", realloc, realloc_moe);
-    fprintf(f, "%f, %f, ", free, free_moe);
-    fprintf(f, "%f, %f, ", total, total_moe);
-    fprintf(f, "%f\n", util);
+    const Char8 *s = separator;
+    fprintf(f, "%s%f", s, util);
+    fprintf(f, "%s%llu", s, reclaimed);
+    fprintf(f, "%s%llu%s%llu", s, sbrk_calls, s, heap_grows);
+    fprintf(f, "%s%llu%s%llu\n", s, page_faults, s, tlb_misses);
 }
 
 void
@@ -22,10 +22,20 @@
 #include "defines.h"
 #include <stdio.h>
 
+// Columns are separated by ", " unless set otherwise, e.g. "\t" for TSV.
+void CSV_Set_Separator(const Char8 *separator);
+
 FILE *CSV_Open(const Char8 *filename);
-void CSV_Write_Header(FILE *f);
+void CSV_Write_Header(FILE *f, const Char8 *const *counters, size_t num_counters);
 void CSV_Close(FILE *f);
-void CSV_Write(FILE *f, const Char8 *trace, F64 malloc, F64 malloc_moe, F64 realloc, F64 realloc_moe, F64 free,
-               F64 free_moe, F64 total, F64 total_moe, F64 util);
+
+// A row is the trace, then the costs of every counter in the order of the
+// header, then the statistics of the heap.
+void CSV_Write_Trace(FILE *f, const Char8 *trace);
+void CSV_Write_Costs(FILE *f, F64 malloc, F64 malloc_moe, F64 calloc, F64 calloc_moe, F64 realloc, F64 realloc_moe,
+                     F64 free, F64 free_moe, F64 malloc_batch, F64 malloc_batch_moe, F64 free_batch,
+                     F64 free_batch_moe, F64 total, F64 total_moe);
+void CSV_Write_Stats(FILE *f, F64 util, U64 reclaimed, U64 sbrk_calls, U64 heap_grows, U64 page_faults,
+                     U64 tlb_misses);
 
 #endif // _CSV_H
@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -26,32 +27,131 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 #include "heapsim.h"
 #include "defines.h"
 
-static U8 *heap;
-static U8 *mem_brk;
-static U8 *mem_max_addr;
+// Discard the whole pages between start and end, which are page aligned, and
+// count the ones that were resident.
+static void
+Heap_Sim_Discard_Pages(Heap_Sim *sim, U8 *start, U8 *end)
+{
+    const size_t page_size = Heap_Sim_Get_Page_Size();
+
+    size_t resident = 0;
+    for (U8 *p = start; p < end;)
+    {
+        U8 vec[0x100];
+        const size_t len = MIN((size_t)(end - p), sizeof(vec) * page_size);
+        if (mincore(p, len, vec) == 0)
+        {
+            for (size_t i = 0; i < len / page_size; i += 1)
+            {
+                resident += vec[i] & 1;
+            }
+        }
+        p += len;
+    }
+
+    if (madvise(start, end - start, MADV_DONTNEED) != 0)
+    {
+        fprintf(stderr, "madvise failed\n");
+        exit(1);
+    }
+
+    atomic_fetch_add_explicit(&sim->reclaimed, resident * page_size, memory_order_relaxed);
+}
+
+#if HEAP_SIM_PAGES == HUGETLB_PAGES
+// Number of free 2 MiB pages in the hugetlbfs pool, read without stdio so that
+// it doesn't allocate.
+static size_t
+Heap_Sim_Get_Free_Huge_Pages(void)
+{
+    const int fd = open("/sys/kernel/mm/hugepages/hugepages-2048kB/free_hugepages", O_RDONLY);
+    if (fd == -1)
+    {
+        return 0;
+    }
+
+    char buf[0x20];
+    const ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    size_t pages = 0;
+    for (ssize_t i = 0; i < n && '0' <= buf[i] && buf[i] <= '9'; i += 1)
+    {
+        pages = pages * 10 + (size_t)(buf[i] - '0');
+    }
+    return pages;
+}
+#endif // HEAP_SIM_PAGES
 
 void
-Heap_Sim_Init(void)
+Heap_Sim_Init(Heap_Sim *sim)
 {
-    U8 *addr = mmap(NULL, MAX_HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    const size_t len = MAX_HEAP_SIZE + HEAP_SIM_ALIGNMENT;
+    U8 *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
     if (addr == MAP_FAILED)
     {
         fprintf(stderr, "mmap failed\n");
         exit(1);
     }
-    heap = addr;
-    mem_max_addr = addr + MAX_HEAP_SIZE;
-    Heap_Sim_Brk();
+    sim->mapping = addr;
+    sim->heap = (U8 *)(((uintptr_t)addr + HEAP_SIM_ALIGNMENT - 1) & ~(uintptr_t)(HEAP_SIM_ALIGNMENT - 1));
+    sim->mem_max_addr = sim->heap + MAX_HEAP_SIZE;
+    sim->mem_clean = sim->heap;
+    sim->heap_page_size = Heap_Sim_Get_Page_Size();
+    sim->owner = NULL;
+
+    // where the heap is backed by transparent huge pages from...
+    U8 *thp_start = addr;
+
+#if HEAP_SIM_PAGES == HUGETLB_PAGES
+    // the whole range stays reserved so that nothing else is mapped where the
+    // heap could be, only its start is replaced with as many huge pages as the
+    // pool holds, which are then guaranteed to be there when first touched,
+    // the heap grows on into normal pages past them...
+    const size_t huge_len = MIN(Heap_Sim_Get_Free_Huge_Pages() * HEAP_SIM_ALIGNMENT, MAX_HEAP_SIZE);
+    const int huge_page_shift = __builtin_ctzll(HEAP_SIM_ALIGNMENT);
+    if (huge_len > 0 &&
+        mmap(sim->heap, huge_len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB | (huge_page_shift << MAP_HUGE_SHIFT), -1,
+             0) != MAP_FAILED)
+    {
+        thp_start = sim->heap + huge_len;
+        sim->heap_page_size = HEAP_SIM_ALIGNMENT;
+    }
+    else
+    {
+        // a failed MAP_FIXED may have unmapped the range, so map it again...
+        if (huge_len > 0 && mmap(sim->heap, huge_len, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+        {
+            fprintf(stderr, "mmap failed\n");
+            exit(1);
+        }
+        fprintf(stderr, "no free huge pages in hugetlbfs, using transparent huge pages\n");
+    }
+#endif // HEAP_SIM_PAGES
+
+#if HEAP_SIM_PAGES != BASE_PAGES
+    // the heap starts on a huge page boundary, so every aligned 2 MiB of it can
+    // be faulted in as one huge page...
+    if (thp_start < addr + len && madvise(thp_start, addr + len - thp_start, MADV_HUGEPAGE) != 0)
+    {
+        fprintf(stderr, "madvise(MADV_HUGEPAGE) failed, using base pages\n");
+    }
+#endif // HEAP_SIM_PAGES
+
+    Heap_Sim_Brk(sim);
 }
 
 void
-Heap_Sim_Release(void)
+Heap_Sim_Release(Heap_Sim *sim)
 {
-    if (munmap(heap, MAX_HEAP_SIZE) != 0)
+    if (munmap(sim->mapping, MAX_HEAP_SIZE + HEAP_SIM_ALIGNMENT) != 0)
     {
         fprintf(stderr, "munmap failed\n");
         exit(1);
@@ -59,33 +159,66 @@ Heap_Sim_Release(void)
 }
 
 void
-Heap_Sim_Brk(void)
+Heap_Sim_Brk(Heap_Sim *sim)
 {
-    mem_brk = heap;
+    // start over on clean pages, whatever the last heap left in them is gone,
+    // in whole huge pages so the next heap can be backed by them again...
+    const size_t page_size = HEAP_SIM_ALIGNMENT;
+    U8 *end = sim->heap + (sim->mem_clean - sim->heap + page_size - 1) / page_size * page_size;
+    if (sim->heap < end)
+    {
+        Heap_Sim_Discard_Pages(sim, sim->heap, end);
+    }
+
+    sim->mem_brk = sim->heap;
+    sim->mem_clean = sim->heap;
+    atomic_store_explicit(&sim->reclaimed, 0, memory_order_relaxed);
+    sim->sbrk_count = 0;
+    sim->grow_count = 0;
 }
 
 void *
-Heap_Sim_Sbrk(intptr_t incr)
+Heap_Sim_Sbrk(Heap_Sim *sim, intptr_t incr)
 {
-    U8 *old_brk = mem_brk;
+    U8 *old_brk = sim->mem_brk;
+    sim->sbrk_count += 1;
 
     bool ok = true;
-    if (incr < 0)
+    if (incr < 0 && sim->mem_brk - sim->heap < -incr)
     {
         ok = false;
-        fprintf(stderr, "ERROR: Heap_Sim_Sbrk failed.  Attempt to expand heap by negative value %ld\n", (long)incr);
+        fprintf(stderr, "ERROR: Heap_Sim_Sbrk failed.  Attempt to shrink heap by %ld bytes below its start\n",
+                (long)-incr);
     }
-    else if (mem_brk + incr > mem_max_addr)
+    else if (sim->mem_brk + incr > sim->mem_max_addr)
     {
         ok = false;
-        long alloc = mem_brk - heap + incr;
+        long alloc = sim->mem_brk - sim->heap + incr;
         fprintf(stderr,
                 "ERROR: Heap_Sim_Sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n",
                 alloc, alloc);
     }
     if (ok)
     {
-        mem_brk += incr;
+        sim->grow_count += incr > 0;
+        sim->mem_brk += incr;
+        if (incr < 0)
+        {
+            // discard every page that now lies entirely past the break...
+            const size_t page_size = sim->heap_page_size;
+            U8 *start = sim->heap + (sim->mem_brk - sim->heap + page_size - 1) / page_size * page_size;
+            U8 *end = sim->heap + (old_brk - sim->heap + page_size - 1) / page_size * page_size;
+            if (start < end)
+            {
+                Heap_Sim_Discard_Pages(sim, start, end);
+            }
+            sim->mem_clean = MIN(sim->mem_clean, start);
+        }
+        else
+        {
+            // the caller is free to write to what it just got...
+            sim->mem_clean = MAX(sim->mem_clean, sim->mem_brk);
+        }
         return (void *)old_brk;
     }
     else
@@ -96,21 +229,39 @@ Heap_Sim_Sbrk(intptr_t incr)
 }
 
 void *
-Heap_Sim_Get_Low(void)
+Heap_Sim_Get_Low(const Heap_Sim *sim)
+{
+    return (void *)sim->heap;
+}
+
+void *
+Heap_Sim_Get_High(const Heap_Sim *sim)
 {
-    return (void *)heap;
+    return (void *)(sim->mem_brk - 1);
 }
 
 void *
-Heap_Sim_Get_High(void)
+Heap_Sim_Get_Clean(const Heap_Sim *sim)
 {
-    return (void *)(mem_brk - 1);
+    return (void *)sim->mem_clean;
 }
 
 size_t
-Heap_Sim_Get_Heap_Size(void)
+Heap_Sim_Get_Heap_Size(const Heap_Sim *sim)
 {
-    return (size_t)(mem_brk - heap);
+    return (size_t)(sim->mem_brk - sim->heap);
+}
+
+size_t
+Heap_Sim_Get_Sbrk_Count(const Heap_Sim *sim)
+{
+    return sim->sbrk_count;
+}
+
+size_t
+Heap_Sim_Get_Grow_Count(const Heap_Sim *sim)
+{
+    return sim->grow_count;
 }
 
 size_t
@@ -118,3 +269,100 @@ Heap_Sim_Get_Page_Size(void)
 {
     return (size_t)getpagesize();
 }
+
+void
+Heap_Sim_Discard(Heap_Sim *sim, void *addr, size_t len)
+{
+    const size_t page_size = sim->heap_page_size;
+    const size_t offset = (U8 *)addr - sim->heap;
+    U8 *start = sim->heap + (offset + page_size - 1) / page_size * page_size;
+    U8 *end = sim->heap + (offset + len) / page_size * page_size;
+    if (start < end)
+    {
+        Heap_Sim_Discard_Pages(sim, start, end);
+    }
+}
+
+size_t
+Heap_Sim_Get_Reclaimed_Size(const Heap_Sim *sim)
+{
+    return atomic_load_explicit(&sim->reclaimed, memory_order_relaxed);
+}
+
+void *
+Heap_Sim_Map(Heap_Sim *sim, size_t len)
+{
+    const size_t page_size = Heap_Sim_Get_Page_Size();
+    len = (len + page_size - 1) / page_size * page_size;
+
+    // unlike the heap, a mapping is committed up front, so a request bigger
+    // than the memory there is fails here rather than killing the process
+    // once it is touched...
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&sim->mapped, len, memory_order_relaxed);
+    return addr;
+}
+
+void *
+Heap_Sim_Remap(Heap_Sim *sim, void *addr, size_t old_len, size_t new_len)
+{
+    const size_t page_size = Heap_Sim_Get_Page_Size();
+    old_len = (old_len + page_size - 1) / page_size * page_size;
+    new_len = (new_len + page_size - 1) / page_size * page_size;
+
+    void *new_addr = mremap(addr, old_len, new_len, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&sim->mapped, new_len - old_len, memory_order_relaxed);
+    return new_addr;
+}
+
+void
+Heap_Sim_Unmap(Heap_Sim *sim, void *addr, size_t len)
+{
+    const size_t page_size = Heap_Sim_Get_Page_Size();
+    len = (len + page_size - 1) / page_size * page_size;
+
+    if (munmap(addr, len) != 0)
+    {
+        fprintf(stderr, "munmap failed\n");
+        exit(1);
+    }
+
+    atomic_fetch_sub_explicit(&sim->mapped, len, memory_order_relaxed);
+}
+
+size_t
+Heap_Sim_Get_Mapped_Size(const Heap_Sim *sim)
+{
+    return atomic_load_explicit(&sim->mapped, memory_order_relaxed);
+}
+
+bool
+Heap_Sim_Claim(Heap_Sim *sim, const void *owner)
+{
+    if (sim->owner && sim->owner != owner)
+    {
+        return false;
+    }
+
+    sim->owner = owner;
+    return true;
+}
+
+void
+Heap_Sim_Unclaim(Heap_Sim *sim, const void *owner)
+{
+    if (sim->owner == owner)
+    {
+        sim->owner = NULL;
+    }
+}
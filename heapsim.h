@@ -22,16 +22,100 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+#include "defines.h"
 
 #define MAX_HEAP_SIZE (1ull * (1ull << 40)) /* 1 TB */
 
-void Heap_Sim_Init(void);
-void Heap_Sim_Release(void);
-void *Heap_Sim_Sbrk(intptr_t incr);
-void Heap_Sim_Brk(void);
-void *Heap_Sim_Get_Low(void);
-void *Heap_Sim_Get_High(void);
-size_t Heap_Sim_Get_Heap_Size(void);
+// The start of the heap is aligned to a huge page, so the ends of the heap at
+// multiples of a page or a huge page from its start are aligned as well.
+#define HEAP_SIM_ALIGNMENT (1ull << 21) /* 2 MB */
+
+// use for defining HEAP_SIM_PAGES compile time value...
+#define BASE_PAGES 0
+#define TRANSPARENT_HUGE_PAGES 1
+#define HUGETLB_PAGES 2
+
+// possible values: BASE_PAGES, TRANSPARENT_HUGE_PAGES, HUGETLB_PAGES
+// what backs the heap: BASE_PAGES are the 4 KiB pages of the OS;
+// TRANSPARENT_HUGE_PAGES asks for 2 MiB pages with madvise(MADV_HUGEPAGE);
+// HUGETLB_PAGES maps 2 MiB pages of the hugetlbfs pool, as many as are free
+// when it starts, and the heap grows on into TRANSPARENT_HUGE_PAGES past them
+#ifndef HEAP_SIM_PAGES
+#define HEAP_SIM_PAGES BASE_PAGES
+#endif
+
+// A simulated heap, every function takes the one it works on so that several
+// can be used side by side, e.g. one for each allocator variant. The storage
+// is the caller's, nothing here allocates.
+typedef struct Heap_Sim
+{
+    // the reservation, the heap starts at its first HEAP_SIM_ALIGNMENT
+    // boundary...
+    U8 *mapping;
+    U8 *heap;
+    // read without the allocator's lock by the threads of a replay...
+    _Atomic(U8 *) mem_brk;
+    U8 *mem_max_addr;
+    // everything from here to mem_max_addr reads as zero, it was never
+    // written since the pages were last discarded...
+    U8 *mem_clean;
+    // bytes of resident memory given back to the OS since the last
+    // Heap_Sim_Brk(...)...
+    atomic_size_t reclaimed;
+    // calls to Heap_Sim_Sbrk(...) and those that raised the heap since the
+    // last Heap_Sim_Brk(...)...
+    size_t sbrk_count;
+    size_t grow_count;
+    // bytes in mappings made with Heap_Sim_Map(...) that are still mapped...
+    atomic_size_t mapped;
+    // the heap can only be discarded in whole pages of this size, which are
+    // huge pages when they come from hugetlbfs...
+    size_t heap_page_size;
+    // whoever allocates from the heap, see Heap_Sim_Claim(...)...
+    const void *owner;
+} Heap_Sim;
+
+void Heap_Sim_Init(Heap_Sim *sim);
+void Heap_Sim_Release(Heap_Sim *sim);
+void *Heap_Sim_Sbrk(Heap_Sim *sim, intptr_t incr);
+void Heap_Sim_Brk(Heap_Sim *sim);
+void *Heap_Sim_Get_Low(const Heap_Sim *sim);
+void *Heap_Sim_Get_High(const Heap_Sim *sim);
+size_t Heap_Sim_Get_Heap_Size(const Heap_Sim *sim);
+
+// Lowest address from which the heap reads as zero because it was never
+// written, memory Heap_Sim_Sbrk(...) returns at or above it needs no clearing.
+void *Heap_Sim_Get_Clean(const Heap_Sim *sim);
+
+// Size of the pages of the OS, the same for every heap.
 size_t Heap_Sim_Get_Page_Size(void);
 
+// Give the whole pages inside len bytes starting at addr back to the OS, they
+// read as zero the next time they are touched.
+void Heap_Sim_Discard(Heap_Sim *sim, void *addr, size_t len);
+
+// Bytes of resident memory released by a negative Heap_Sim_Sbrk(...) or by
+// Heap_Sim_Discard(...) since the last Heap_Sim_Brk(...).
+size_t Heap_Sim_Get_Reclaimed_Size(const Heap_Sim *sim);
+
+// Calls to Heap_Sim_Sbrk(...), and the ones among them that raised the heap,
+// since the last Heap_Sim_Brk(...).
+size_t Heap_Sim_Get_Sbrk_Count(const Heap_Sim *sim);
+size_t Heap_Sim_Get_Grow_Count(const Heap_Sim *sim);
+
+// Mappings outside of the heap for allocations too big to live in it, lengths
+// are rounded up to whole pages.
+void *Heap_Sim_Map(Heap_Sim *sim, size_t len);
+void *Heap_Sim_Remap(Heap_Sim *sim, void *addr, size_t old_len, size_t new_len);
+void Heap_Sim_Unmap(Heap_Sim *sim, void *addr, size_t len);
+size_t Heap_Sim_Get_Mapped_Size(const Heap_Sim *sim);
+
+// Claim the heap for owner, e.g. the allocator context set up on it, returns
+// false while another owner holds it: two allocators on one heap would hand
+// out the same memory. Claiming it again for the same owner succeeds.
+bool Heap_Sim_Claim(Heap_Sim *sim, const void *owner);
+void Heap_Sim_Unclaim(Heap_Sim *sim, const void *owner);
+
 #endif // _HEAPSIM_H
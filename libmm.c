@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2024 Patel, Nimai <nimai.m.patel@gmail.com>
+ * Author: Patel, Nimai <nimai.m.patel@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The malloc family of the C library on top of mm.c, built into libmm.so by
+// `build.sh preload` so that real programs can be run against the allocator:
+//
+//     LD_PRELOAD=./libmm.so ./my_program
+//
+// The heap is the reserved mapping of heapsim.c, the first call into any of
+// these functions sets it up. Nothing on that path allocates, so it is safe
+// however early the dynamic loader or a constructor calls malloc.
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <malloc.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "heapsim.h"
+#include "defines.h"
+#include "config.h"
+
+#if ARENA_COUNT < 2
+#error "libmm.so can be called from many threads, build it with ARENA_COUNT of at least 2"
+#endif
+
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t lib_once = PTHREAD_ONCE_INIT;
+
+// the heap of the process and the allocator's context on it, nothing may be
+// allocated to set them up...
+static Heap_Sim lib_heap;
+static M_Context *lib_context;
+
+static void
+Lib_Fork_Prepare(void)
+{
+    M_Lock_All(lib_context);
+}
+
+static void
+Lib_Fork_Done(void)
+{
+    M_Unlock_All(lib_context);
+}
+
+static void
+Lib_Init_Once(void)
+{
+    Heap_Sim_Init(&lib_heap);
+    lib_context = M_Create();
+    if (!lib_context || !M_Init(lib_context, &lib_heap))
+    {
+        abort();
+    }
+
+    // whichever thread forks holds every lock, so the child starts with none
+    // of them held...
+    pthread_atfork(Lib_Fork_Prepare, Lib_Fork_Done, Lib_Fork_Done);
+}
+
+static inline void
+Lib_Init(void)
+{
+    pthread_once(&lib_once, Lib_Init_Once);
+}
+
+// Out of memory is reported through errno like the C library does.
+static inline void *
+Lib_Check(void *ptr)
+{
+    if (!ptr)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+EXPORT void *
+malloc(size_t size)
+{
+    Lib_Init();
+    // like glibc, malloc(0) returns a unique pointer and not NULL, which many
+    // programs take for a failure...
+    return Lib_Check(M_malloc(lib_context, MAX(size, 1)));
+}
+
+EXPORT void
+free(void *ptr)
+{
+    if (ptr)
+    {
+        M_free(lib_context, ptr);
+    }
+}
+
+EXPORT void *
+calloc(size_t nmemb, size_t size)
+{
+    Lib_Init();
+    if (nmemb == 0 || size == 0)
+    {
+        nmemb = 1;
+        size = 1;
+    }
+    return Lib_Check(M_calloc(lib_context, nmemb, size));
+}
+
+EXPORT void *
+realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+    {
+        return malloc(size);
+    }
+    if (size == 0)
+    {
+        M_free(lib_context, ptr);
+        return NULL;
+    }
+    return Lib_Check(M_realloc(lib_context, ptr, size));
+}
+
+EXPORT void *
+reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+EXPORT int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
+
+    Lib_Init();
+    void *ptr = M_aligned_alloc(lib_context, alignment, MAX(size, 1));
+    if (!ptr)
+    {
+        return ENOMEM;
+    }
+
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    Lib_Init();
+    return Lib_Check(M_aligned_alloc(lib_context, alignment, MAX(size, 1)));
+}
+
+EXPORT void *
+memalign(size_t alignment, size_t size)
+{
+    Lib_Init();
+    return Lib_Check(M_memalign(lib_context, alignment, MAX(size, 1)));
+}
+
+EXPORT void *
+valloc(size_t size)
+{
+    return memalign(Heap_Sim_Get_Page_Size(), size);
+}
+
+EXPORT void *
+pvalloc(size_t size)
+{
+    const size_t page_size = Heap_Sim_Get_Page_Size();
+    return memalign(page_size, (MAX(size, 1) + page_size - 1) / page_size * page_size);
+}
+
+EXPORT void
+free_sized(void *ptr, size_t size)
+{
+    if (ptr)
+    {
+        M_free_sized(lib_context, ptr, size);
+    }
+}
+
+EXPORT size_t
+malloc_usable_size(void *ptr)
+{
+    return M_malloc_usable_size(lib_context, ptr);
+}
@@ -16,10 +16,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <glob.h>
+#include <fnmatch.h>
 #include <linux/perf_event.h>
 
 #include "heapsim.h"
@@ -27,9 +33,27 @@
 #include "trace_parser.h"
 #include "trace.h"
 #include "csv.h"
-#include "config.h"
+#include "mm.h"
 
-static Char8 *traces[] = {
+// The allocator variants linked into the binary, build.sh defines
+// MM_VARIANTS as a list of VARIANT(name) for every copy of mm.c it compiled.
+#ifndef MM_VARIANTS
+#error MM_VARIANTS is not defined...
+#endif
+
+#define VARIANT(name) extern const M_Allocator M_Allocator_##name;
+MM_VARIANTS
+#undef VARIANT
+
+static const M_Allocator *allocators[] = {
+#define VARIANT(name) &M_Allocator_##name,
+    MM_VARIANTS
+#undef VARIANT
+};
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(*allocators))
+
+// Traces replayed when none are given on the command line.
+static const Char8 *default_traces[] = {
     // These are traces from CMU malloc lab, used in this project with
     // permission from professor Randy Bryant and Professor David O'Hallaron
 
@@ -40,78 +64,709 @@ static Char8 *traces[] = {
     "traces/syn-mix.rep", "traces/syn-mix-short.rep", "traces/syn-string.rep", "traces/syn-string-short.rep",
     "traces/syn-struct.rep", "traces/syn-struct-short.rep",
 
-    // trace for lox interpreter from
-    // https://github.com/munificent/craftinginterpreters/ running
-    // test/benchmark/trees.lox refer readme.txt to see how to run generate
-    // trace for your own program
-    "traces/clox-trees-lox.rep"
+    // synthetic trace of graphs of nodes allocated and freed in batches with
+    // M_malloc_batch(...) and M_free_batch(...)
+    "traces/syn-batch.rep",
+
+    // synthetic trace of tables allocated with M_calloc(...), partly from
+    // fresh heap that isn't cleared and partly from freed memory that is
+    "traces/syn-calloc.rep",
+
+    // synthetic trace of blocks allocated with M_aligned_alloc(...) and
+    // M_memalign(...), reallocated, and freed half with M_free_sized(...)
+    "traces/syn-aligned.rep",
+
+    // traces of your own programs, see readme.txt for how to generate them,
+    // are passed on the command line
 };
-#define NUM_TRACES (sizeof(traces) / sizeof(*traces))
+#define NUM_DEFAULT_TRACES (sizeof(default_traces) / sizeof(*default_traces))
 
-int
-main(void)
+// Events that can be counted for every op by name, like the names perf(1)
+// gives them. Each event counted gets its own set of columns in the CSV.
+static const Perf_Event known_events[] = {
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "dTLB-load-misses", PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+#define NUM_KNOWN_EVENTS (sizeof(known_events) / sizeof(*known_events))
+
+// Events counted when none are given on the command line. The kernel
+// schedules them as one group, so they must all fit in the hardware counters
+// of the CPU at once or none of them count. Events the machine doesn't have,
+// like hardware events in most virtual machines, are left out of the group
+// and their columns are 0. They are all hardware events, so every op is
+// counted with rdpmc alone; a software event, like -e page-faults, can't be
+// read that way and costs a read() before and after every op.
+static const Char8 *default_events[] = { "instructions", "cycles", "cache-misses", "branch-misses" };
+#define NUM_DEFAULT_EVENTS (sizeof(default_events) / sizeof(*default_events))
+
+// What the command line asked for, filled in by Parse_Options(...).
+typedef struct Options
+{
+    // paths of the traces, after expanding globs and dropping excluded ones...
+    const Char8 **traces;
+    size_t num_traces;
+    Perf_Event events[PERF_GROUP_MAX];
+    size_t num_events;
+    // replays of every trace that are counted, and the ones before them that
+    // aren't...
+    size_t reps;
+    size_t warmups;
+    // the files are <output><variant>.<format>...
+    const Char8 *output;
+    const Char8 *format;
+    // globs on the names of the variants to run, all of them when empty...
+    const Char8 *variants[0x40];
+    size_t num_variants;
+    // replays of one trace against one variant that run at once, see
+    // Run_Jobs(...)...
+    size_t jobs;
+    // threads replaying every trace at once against the same heap...
+    size_t threads;
+} Options;
+
+static Options options;
+
+// A trace parsed once up front, every variant replays the same one...
+typedef struct Trace_Input
+{
+    const Char8 *name;
+    String input;
+    Trace trace;
+} Trace_Input;
+
+static Trace_Input *inputs;
+static size_t num_inputs;
+static const Char8 *event_names[PERF_GROUP_MAX];
+
+// Statistics of one allocator variant over all traces.
+typedef struct Variant_Stats
 {
-    Heap_Sim_Init();
+    const M_Allocator *allocator;
+    FILE *f;
+    Trace_Costs costs[PERF_GROUP_MAX];
+    double util_sum;
+    U64 reclaimed_sum;
+    U64 sbrk_calls_sum;
+    U64 heap_grows_sum;
+    U64 page_faults_sum;
+    U64 tlb_misses_sum;
+} Variant_Stats;
+
+// The replays of one trace against one variant, on a heap and context of their
+// own so that any number of jobs can run at once.
+typedef struct Replay_Job
+{
+    const M_Allocator *allocator;
+    const Trace_Input *input;
+    // the costs of the ops of every counted replay, and the statistics of the
+    // last one with its page faults and dTLB misses averaged over all...
+    Trace_Costs costs[PERF_GROUP_MAX];
+    Trace_Run_Result result;
+    // set under jobs_lock once the job has run...
+    bool done;
+} Replay_Job;
+
+// Every variant's jobs in the order of the traces, one variant after another.
+// Workers take the next job that hasn't started, and the main thread writes
+// the results in order as they are done...
+static Replay_Job *jobs;
+static size_t num_jobs;
+static atomic_size_t next_job;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_done = PTHREAD_COND_INITIALIZER;
+
+static void
+Usage(FILE *f)
+{
+    fprintf(f, "usage: main [options] [trace ...]\n"
+               "\n"
+               "Replays every trace against every allocator variant and writes the statistics of\n"
+               "each variant to <prefix><variant>.<format>. Traces are files or globs, by default\n"
+               "the traces[] of main.c.\n"
+               "\n"
+               "  -e EVENT   count EVENT for every op, once for each event, by name or as\n"
+               "             TYPE:CONFIG of perf_event_open, e.g. 4:0x1b0 for a raw event\n"
+               "  -r N       replays of every trace that are counted (1)\n"
+               "  -w N       replays of every trace before those that aren't counted (0)\n"
+               "  -o PREFIX  prefix of the output files, e.g. out/ for a directory (none)\n"
+               "  -f FORMAT  csv or tsv (csv)\n"
+               "  -x GLOB    skip the traces whose file name matches GLOB\n"
+               "  -a GLOB    only run the variants whose name matches GLOB\n"
+               "  -j N       replay N traces at once, each against one variant on its own\n"
+               "             thread and CPU; utilization and heap growth are the same as with\n"
+               "             -j 1, but the replays share caches, memory bandwidth and TLB\n"
+               "             reach, so the costs of the ops aren't comparable to -j 1 (1)\n"
+               "  -t N       replay every trace in N threads at once on the same heap, only\n"
+               "             the variants with more than one arena take part (1)\n"
+               "  -l         list the events and variants and exit\n"
+               "  -h         show this help\n");
+}
+
+static void
+List(void)
+{
+    printf("events:\n");
+    for (size_t k = 0; k < NUM_KNOWN_EVENTS; k += 1)
+    {
+        printf("  %s\n", known_events[k].name);
+    }
+    printf("variants:\n");
+    for (size_t j = 0; j < NUM_ALLOCATORS; j += 1)
+    {
+        printf("  %s\n", allocators[j]->name);
+    }
+}
+
+static size_t
+Parse_Count(const Char8 *arg, Char8 opt)
+{
+    Char8 *end;
+    const unsigned long long n = strtoull(arg, &end, 0);
+    if (*arg == '\0' || *end != '\0' || *arg == '-')
+    {
+        fprintf(stderr, "-%c takes a number, not %s\n", opt, arg);
+        exit(1);
+    }
+    return n;
+}
+
+static Perf_Event
+Parse_Event(const Char8 *arg)
+{
+    for (size_t k = 0; k < NUM_KNOWN_EVENTS; k += 1)
+    {
+        if (strcmp(arg, known_events[k].name) == 0)
+        {
+            return known_events[k];
+        }
+    }
 
-    Vec_U64 malloc_cyc = { 0 };
-    Vec_U64 realloc_cyc = { 0 };
-    Vec_U64 free_cyc = { 0 };
+    // anything else is TYPE:CONFIG of perf_event_open...
+    Char8 *colon;
+    Char8 *end;
+    const U64 type = strtoull(arg, &colon, 0);
+    if (colon != arg && *colon == ':')
+    {
+        const U64 config = strtoull(colon + 1, &end, 0);
+        if (end != colon + 1 && *end == '\0')
+        {
+            return (Perf_Event){ arg, type, config };
+        }
+    }
 
-    double util_sum = 0;
+    fprintf(stderr, "Unknown event %s, see main -l\n", arg);
+    exit(1);
+}
 
-    FILE *f = CSV_Open(RUN_NAME ".csv");
-    CSV_Write_Header(f);
+static void
+Add_Trace(const Char8 *path, const Char8 *const *excludes, size_t num_excludes)
+{
+    Char8 *copy = strdup(path);
+    for (size_t x = 0; x < num_excludes; x += 1)
+    {
+        if (fnmatch(excludes[x], basename(copy), 0) == 0)
+        {
+            free(copy);
+            return;
+        }
+    }
+    free(copy);
 
-    for (size_t i = 0; i < NUM_TRACES; i += 1)
+    options.traces = realloc(options.traces, (options.num_traces + 1) * sizeof(*options.traces));
+    if (!options.traces)
     {
-        String input = String_Read_File(traces[i]);
-        Trace trace = Trace_Parse(String_Slice(input, 0, input.len));
+        fprintf(stderr, "realloc failed\n");
+        exit(1);
+    }
+    options.traces[options.num_traces] = strdup(path);
+    options.num_traces += 1;
+}
 
-        Trace_Run_Result result = Trace_Run(trace, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+static void
+Parse_Options(int argc, Char8 **argv)
+{
+    options.reps = 1;
+    options.jobs = 1;
+    options.threads = 1;
+    options.output = "";
+    options.format = "csv";
 
-        Vec_U64 overall = { 0 };
-        Vec_U64_Append(&overall, result.malloc_cyc, result.realloc_cyc, result.free_cyc);
+    const Char8 *excludes[0x40];
+    size_t num_excludes = 0;
 
-        Vec_U64_Stats_Result malloc = Vec_U64_Stats(result.malloc_cyc);
-        Vec_U64_Stats_Result realloc = Vec_U64_Stats(result.realloc_cyc);
-        Vec_U64_Stats_Result free = Vec_U64_Stats(result.free_cyc);
-        Vec_U64_Stats_Result total = Vec_U64_Stats(overall);
+    int opt;
+    while ((opt = getopt(argc, argv, "e:r:w:o:f:x:a:j:t:lh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            if (options.num_events == PERF_GROUP_MAX)
+            {
+                fprintf(stderr, "At most %d events can be counted together\n", PERF_GROUP_MAX);
+                exit(1);
+            }
+            options.events[options.num_events] = Parse_Event(optarg);
+            options.num_events += 1;
+            break;
+        case 'r':
+            options.reps = Parse_Count(optarg, 'r');
+            break;
+        case 'w':
+            options.warmups = Parse_Count(optarg, 'w');
+            break;
+        case 'o':
+            options.output = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") != 0 && strcmp(optarg, "tsv") != 0)
+            {
+                fprintf(stderr, "Unknown format %s, it can be csv or tsv\n", optarg);
+                exit(1);
+            }
+            options.format = optarg;
+            break;
+        case 'x':
+        case 'a':
+            if ((opt == 'x' ? num_excludes : options.num_variants) == 0x40)
+            {
+                fprintf(stderr, "Too many -%c\n", opt);
+                exit(1);
+            }
+            if (opt == 'x')
+            {
+                excludes[num_excludes] = optarg;
+                num_excludes += 1;
+            }
+            else
+            {
+                options.variants[options.num_variants] = optarg;
+                options.num_variants += 1;
+            }
+            break;
+        case 'j':
+            options.jobs = Parse_Count(optarg, 'j');
+            break;
+        case 't':
+            options.threads = Parse_Count(optarg, 't');
+            break;
+        case 'l':
+            List();
+            exit(0);
+        case 'h':
+            Usage(stdout);
+            exit(0);
+        default:
+            Usage(stderr);
+            exit(1);
+        }
+    }
 
-        CSV_Write(f, basename(traces[i]), malloc.mean, malloc.margin_of_error, realloc.mean, realloc.margin_of_error,
-                  free.mean, free.margin_of_error, total.mean, total.margin_of_error, result.util);
+    if (options.reps == 0)
+    {
+        fprintf(stderr, "-r must be at least 1\n");
+        exit(1);
+    }
+    if (options.jobs == 0)
+    {
+        fprintf(stderr, "-j must be at least 1\n");
+        exit(1);
+    }
+    if (options.threads == 0)
+    {
+        fprintf(stderr, "-t must be at least 1\n");
+        exit(1);
+    }
 
-        util_sum += result.util;
-        Vec_U64_Append(&malloc_cyc, result.malloc_cyc);
-        Vec_U64_Append(&realloc_cyc, result.realloc_cyc);
-        Vec_U64_Append(&free_cyc, result.free_cyc);
+    if (options.num_events == 0)
+    {
+        for (size_t k = 0; k < NUM_DEFAULT_EVENTS; k += 1)
+        {
+            options.events[k] = Parse_Event(default_events[k]);
+        }
+        options.num_events = NUM_DEFAULT_EVENTS;
+    }
 
-        // loop_clean_up
-        Vec_U64_Release(result.malloc_cyc);
-        Vec_U64_Release(result.realloc_cyc);
-        Vec_U64_Release(result.free_cyc);
-        Vec_U64_Release(overall);
+    if (optind == argc)
+    {
+        for (size_t i = 0; i < NUM_DEFAULT_TRACES; i += 1)
+        {
+            Add_Trace(default_traces[i], excludes, num_excludes);
+        }
+        return;
+    }
 
-        Trace_Release(trace);
-        String_Release(input);
+    // globs the shell didn't expand, e.g. quoted ones, are expanded here in
+    // sorted order, a glob matching nothing is taken as a path...
+    for (int a = optind; a < argc; a += 1)
+    {
+        glob_t paths;
+        if (glob(argv[a], GLOB_NOCHECK, NULL, &paths) != 0)
+        {
+            fprintf(stderr, "Can't expand %s\n", argv[a]);
+            exit(1);
+        }
+        for (size_t i = 0; i < paths.gl_pathc; i += 1)
+        {
+            Add_Trace(paths.gl_pathv[i], excludes, num_excludes);
+        }
+        globfree(&paths);
     }
+}
 
+static bool
+Variant_Selected(const M_Allocator *allocator)
+{
+    // a single arena isn't thread safe...
+    if (options.threads > 1 && !allocator->thread_safe)
+    {
+        return false;
+    }
+    if (options.num_variants == 0)
+    {
+        return true;
+    }
+    for (size_t v = 0; v < options.num_variants; v += 1)
+    {
+        if (fnmatch(options.variants[v], allocator->name, 0) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Write the columns of one counter, the mean and margin of error of the cost
+// of every type of op.
+static void
+Write_Costs(FILE *f, Trace_Costs c)
+{
     Vec_U64 overall = { 0 };
-    Vec_U64_Append(&overall, malloc_cyc, realloc_cyc, free_cyc);
+    Vec_U64_Append(&overall, c.malloc_cyc, c.calloc_cyc, c.realloc_cyc, c.free_cyc, c.malloc_batch_cyc,
+                   c.free_batch_cyc);
 
-    Vec_U64_Stats_Result malloc = Vec_U64_Stats(malloc_cyc);
-    Vec_U64_Stats_Result realloc = Vec_U64_Stats(realloc_cyc);
-    Vec_U64_Stats_Result free = Vec_U64_Stats(free_cyc);
+    Vec_U64_Stats_Result malloc = Vec_U64_Stats(c.malloc_cyc);
+    Vec_U64_Stats_Result calloc = Vec_U64_Stats(c.calloc_cyc);
+    Vec_U64_Stats_Result realloc = Vec_U64_Stats(c.realloc_cyc);
+    Vec_U64_Stats_Result free = Vec_U64_Stats(c.free_cyc);
+    Vec_U64_Stats_Result malloc_batch = Vec_U64_Stats(c.malloc_batch_cyc);
+    Vec_U64_Stats_Result free_batch = Vec_U64_Stats(c.free_batch_cyc);
     Vec_U64_Stats_Result total = Vec_U64_Stats(overall);
-    F64 util = util_sum / NUM_TRACES;
 
-    CSV_Write(f, "All Traces", malloc.mean, malloc.margin_of_error, realloc.mean, realloc.margin_of_error, free.mean,
-              free.margin_of_error, total.mean, total.margin_of_error, util);
+    CSV_Write_Costs(f, malloc.mean, malloc.margin_of_error, calloc.mean, calloc.margin_of_error, realloc.mean,
+                    realloc.margin_of_error, free.mean, free.margin_of_error, malloc_batch.mean,
+                    malloc_batch.margin_of_error, free_batch.mean, free_batch.margin_of_error, total.mean,
+                    total.margin_of_error);
 
-    Vec_U64_Release(malloc_cyc);
-    Vec_U64_Release(realloc_cyc);
-    Vec_U64_Release(free_cyc);
     Vec_U64_Release(overall);
+}
+
+// Replay the trace of the job against its variant, the warmups and then the
+// counted replays, on a heap and context set up for the job alone.
+static void
+Run_Job(Replay_Job *job)
+{
+    const size_t num_events = options.num_events;
+
+    Heap_Sim heap;
+    Heap_Sim_Init(&heap);
+    M_Context *ctx = job->allocator->create();
+    if (!ctx)
+    {
+        fprintf(stderr, "Can't create a context for %s\n", job->allocator->name);
+        exit(1);
+    }
+
+    for (size_t w = 0; w < options.warmups; w += 1)
+    {
+        Trace_Run_Result result =
+            Trace_Run(job->allocator, ctx, &heap, job->input->trace, options.events, num_events, options.threads);
+        for (size_t k = 0; k < num_events; k += 1)
+        {
+            Trace_Costs_Release(result.costs[k]);
+        }
+    }
+
+    // the costs of every replay are pooled and the page faults and dTLB
+    // misses averaged, the rest is the same for every replay...
+    Trace_Run_Result result = { 0 };
+    U64 page_faults = 0;
+    U64 tlb_misses = 0;
+    for (size_t r = 0; r < options.reps; r += 1)
+    {
+        result = Trace_Run(job->allocator, ctx, &heap, job->input->trace, options.events, num_events, options.threads);
+        page_faults += result.page_faults;
+        tlb_misses += result.tlb_misses;
+        for (size_t k = 0; k < num_events; k += 1)
+        {
+            Trace_Costs *c = &job->costs[k];
+            Vec_U64_Append(&c->malloc_cyc, result.costs[k].malloc_cyc);
+            Vec_U64_Append(&c->calloc_cyc, result.costs[k].calloc_cyc);
+            Vec_U64_Append(&c->realloc_cyc, result.costs[k].realloc_cyc);
+            Vec_U64_Append(&c->free_cyc, result.costs[k].free_cyc);
+            Vec_U64_Append(&c->malloc_batch_cyc, result.costs[k].malloc_batch_cyc);
+            Vec_U64_Append(&c->free_batch_cyc, result.costs[k].free_batch_cyc);
+
+            // loop_clean_up
+            Trace_Costs_Release(result.costs[k]);
+        }
+    }
+    result.page_faults = page_faults / options.reps;
+    result.tlb_misses = tlb_misses / options.reps;
+    job->result = result;
+
+    job->allocator->release(ctx);
+    Heap_Sim_Release(&heap);
+}
+
+// Run jobs until none are left, on the CPU given as arg or any when it is -1.
+// Counters only count the thread they are opened on and every job has its own
+// heap and context, so a job counts the same whichever worker runs it and
+// whatever runs next to it, only its costs change with what the other workers
+// do to the caches, memory bandwidth and TLB of the machine.
+static void *
+Run_Jobs(void *arg)
+{
+    const int cpu = (int)(intptr_t)arg;
+
+    // pinned before any heap is set up, so its pages come from the memory
+    // next to the CPU...
+    if (cpu != -1)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        {
+            fprintf(stderr, "Can't pin a worker to CPU %d\n", cpu);
+        }
+    }
+
+    for (;;)
+    {
+        const size_t n = atomic_fetch_add(&next_job, 1);
+        if (n >= num_jobs)
+        {
+            return NULL;
+        }
+
+        Run_Job(&jobs[n]);
+
+        pthread_mutex_lock(&jobs_lock);
+        jobs[n].done = true;
+        pthread_cond_broadcast(&jobs_done);
+        pthread_mutex_unlock(&jobs_lock);
+    }
+}
+
+// Write the row of a job that is done to the CSV of its variant and add it to
+// the variant's statistics over all traces.
+static void
+Write_Job(Variant_Stats *s, Replay_Job *job)
+{
+    const size_t num_events = options.num_events;
+    const Trace_Run_Result result = job->result;
+
+    CSV_Write_Trace(s->f, job->input->name);
+    for (size_t k = 0; k < num_events; k += 1)
+    {
+        Write_Costs(s->f, job->costs[k]);
+    }
+    CSV_Write_Stats(s->f, result.util, result.reclaimed, result.sbrk_calls, result.heap_grows, result.page_faults,
+                    result.tlb_misses);
+
+    s->util_sum += result.util;
+    s->reclaimed_sum += result.reclaimed;
+    s->sbrk_calls_sum += result.sbrk_calls;
+    s->heap_grows_sum += result.heap_grows;
+    s->page_faults_sum += result.page_faults;
+    s->tlb_misses_sum += result.tlb_misses;
+    for (size_t k = 0; k < num_events; k += 1)
+    {
+        Trace_Costs *c = &s->costs[k];
+        Vec_U64_Append(&c->malloc_cyc, job->costs[k].malloc_cyc);
+        Vec_U64_Append(&c->calloc_cyc, job->costs[k].calloc_cyc);
+        Vec_U64_Append(&c->realloc_cyc, job->costs[k].realloc_cyc);
+        Vec_U64_Append(&c->free_cyc, job->costs[k].free_cyc);
+        Vec_U64_Append(&c->malloc_batch_cyc, job->costs[k].malloc_batch_cyc);
+        Vec_U64_Append(&c->free_batch_cyc, job->costs[k].free_batch_cyc);
+        Trace_Costs_Release(job->costs[k]);
+    }
+}
+
+// Write the CSV of one variant, a row for every trace in order and one for all
+// of them. Its jobs are run here when there are no workers, otherwise the
+// rows are written as the workers finish them.
+static void
+Write_Variant(Variant_Stats *s, Replay_Job *variant_jobs)
+{
+    const size_t num_events = options.num_events;
+
+    // every variant writes its statistics to a file named after it...
+    Char8 filename[0x1000];
+    snprintf(filename, sizeof(filename), "%s%s.%s", options.output, s->allocator->name, options.format);
+    s->f = CSV_Open(filename);
+    if (!s->f)
+    {
+        fprintf(stderr, "Can't open %s\n", filename);
+        exit(1);
+    }
+    CSV_Write_Header(s->f, event_names, num_events);
+
+    for (size_t i = 0; i < num_inputs; i += 1)
+    {
+        Replay_Job *job = &variant_jobs[i];
+        if (options.jobs == 1)
+        {
+            Run_Job(job);
+        }
+        else
+        {
+            pthread_mutex_lock(&jobs_lock);
+            while (!job->done)
+            {
+                pthread_cond_wait(&jobs_done, &jobs_lock);
+            }
+            pthread_mutex_unlock(&jobs_lock);
+        }
+
+        Write_Job(s, job);
+    }
+
+    F64 util = num_inputs ? s->util_sum / num_inputs : 0;
+
+    CSV_Write_Trace(s->f, "All Traces");
+    for (size_t k = 0; k < num_events; k += 1)
+    {
+        Write_Costs(s->f, s->costs[k]);
+        Trace_Costs_Release(s->costs[k]);
+    }
+    CSV_Write_Stats(s->f, util, s->reclaimed_sum, s->sbrk_calls_sum, s->heap_grows_sum, s->page_faults_sum,
+                    s->tlb_misses_sum);
+    CSV_Close(s->f);
+}
+
+int
+main(int argc, Char8 **argv)
+{
+    Parse_Options(argc, argv);
+
+    CSV_Set_Separator(strcmp(options.format, "tsv") == 0 ? "\t" : ", ");
+    for (size_t k = 0; k < options.num_events; k += 1)
+    {
+        event_names[k] = options.events[k].name;
+    }
+
+    Variant_Stats stats[NUM_ALLOCATORS] = { 0 };
+    size_t num_stats = 0;
+    for (size_t j = 0; j < NUM_ALLOCATORS; j += 1)
+    {
+        if (Variant_Selected(allocators[j]))
+        {
+            stats[num_stats].allocator = allocators[j];
+            num_stats += 1;
+        }
+    }
+    if (num_stats == 0)
+    {
+        fprintf(stderr, "No variant matches -a%s, see main -l\n",
+                options.threads > 1 ? " and has the arenas -t needs" : "");
+        exit(1);
+    }
+
+    inputs = calloc(options.num_traces, sizeof(*inputs));
+    if (options.num_traces && !inputs)
+    {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < options.num_traces; i += 1)
+    {
+        Trace_Input *in = &inputs[num_inputs];
+        in->input = String_Read_File(options.traces[i]);
+        if (!in->input.data)
+        {
+            fprintf(stderr, "Can't read %s, skipping it\n", options.traces[i]);
+            continue;
+        }
+        in->name = basename((Char8 *)options.traces[i]);
+        in->trace = Trace_Parse(String_Slice(in->input, 0, in->input.len));
+        num_inputs += 1;
+    }
+
+    num_jobs = num_stats * num_inputs;
+    jobs = calloc(num_jobs, sizeof(*jobs));
+    if (num_jobs && !jobs)
+    {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+    for (size_t j = 0; j < num_stats; j += 1)
+    {
+        for (size_t i = 0; i < num_inputs; i += 1)
+        {
+            jobs[j * num_inputs + i].allocator = stats[j].allocator;
+            jobs[j * num_inputs + i].input = &inputs[i];
+        }
+    }
+
+    // with -j 1 the jobs run one after another on the main thread as their
+    // rows are written, otherwise the workers take them in the same order and
+    // go round the CPUs the process may run on, so with fewer CPUs than
+    // workers some of them share one. The threads of a replay would all
+    // inherit the CPU of their worker, so with -t they aren't pinned...
+    const size_t num_workers = options.jobs == 1 ? 0 : MIN(options.jobs, num_jobs);
+    pthread_t *workers = calloc(num_workers, sizeof(*workers));
+    if (num_workers && !workers)
+    {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+    cpu_set_t allowed;
+    const bool pin =
+        options.threads == 1 && sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0;
+    int cpu = -1;
+    for (size_t w = 0; w < num_workers; w += 1)
+    {
+        if (pin)
+        {
+            do
+            {
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            } while (!CPU_ISSET(cpu, &allowed));
+        }
+        if (pthread_create(&workers[w], NULL, Run_Jobs, (void *)(intptr_t)cpu) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    for (size_t j = 0; j < num_stats; j += 1)
+    {
+        Write_Variant(&stats[j], &jobs[j * num_inputs]);
+    }
+
+    for (size_t w = 0; w < num_workers; w += 1)
+    {
+        pthread_join(workers[w], NULL);
+    }
+    free(workers);
+    free(jobs);
+
+    for (size_t i = 0; i < num_inputs; i += 1)
+    {
+        Trace_Release(inputs[i].trace);
+        String_Release(inputs[i].input);
+    }
+    free(inputs);
 
-    Heap_Sim_Release();
     return 0;
 }
@@ -23,6 +23,33 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+// Compiled as one of several variants, see M_Allocator in mm.h...
+#ifdef MM_VARIANT
+#define MM_VARIANT_PASTE(name, variant) name##_##variant
+#define MM_VARIANT_EXPAND(name, variant) MM_VARIANT_PASTE(name, variant)
+#define MM_VARIANT_NAME(name) MM_VARIANT_EXPAND(name, MM_VARIANT)
+#define MM_VARIANT_STRING_(variant) #variant
+#define MM_VARIANT_STRING(variant) MM_VARIANT_STRING_(variant)
+#define M_Create MM_VARIANT_NAME(M_Create)
+#define M_Release MM_VARIANT_NAME(M_Release)
+#define M_Init MM_VARIANT_NAME(M_Init)
+#define M_malloc MM_VARIANT_NAME(M_malloc)
+#define M_calloc MM_VARIANT_NAME(M_calloc)
+#define M_realloc MM_VARIANT_NAME(M_realloc)
+#define M_free MM_VARIANT_NAME(M_free)
+#define M_malloc_batch MM_VARIANT_NAME(M_malloc_batch)
+#define M_free_batch MM_VARIANT_NAME(M_free_batch)
+#define M_aligned_alloc MM_VARIANT_NAME(M_aligned_alloc)
+#define M_memalign MM_VARIANT_NAME(M_memalign)
+#define M_free_sized MM_VARIANT_NAME(M_free_sized)
+#define M_malloc_usable_size MM_VARIANT_NAME(M_malloc_usable_size)
+#define M_Lock_All MM_VARIANT_NAME(M_Lock_All)
+#define M_Unlock_All MM_VARIANT_NAME(M_Unlock_All)
+#endif // MM_VARIANT
 
 #include "mm.h"
 #include "heapsim.h"
@@ -44,9 +71,6 @@
 // and two words each of which are one word long...
 static_assert(MIN_BLOCK_SIZE == 0x2, "");
 
-static Word *free_table[FREE_TABLE_SIZE] = { 0 };
-static_assert(sizeof(free_table) <= 128, "");
-
 #ifndef BEST_FIT_SEARCH_LIMIT
 #error BEST_FIT_SEARCH_LIMIT is not defined...
 #endif
@@ -71,14 +95,304 @@ static_assert(sizeof(free_table) <= 128, "");
 #error FREE_TABLE_SIZE is not defined...
 #endif
 
-static bool Heap_Check(size_t lineno);
+#ifdef SLAB_MAX_SIZE
+#if SLAB_MAX_SIZE < 0 || SLAB_MAX_SIZE > 0x400 || SLAB_MAX_SIZE % 0x10 != 0
+#error SLAB_MAX_SIZE should be a multiple of 16 between 0 and 1024
+#endif
+#else
+#error SLAB_MAX_SIZE is not defined...
+#endif
+
+#ifdef FAST_BIN_MAX_SIZE
+#if FAST_BIN_MAX_SIZE < 0 || FAST_BIN_MAX_SIZE > 0x400 || FAST_BIN_MAX_SIZE % 0x10 != 0
+#error FAST_BIN_MAX_SIZE should be a multiple of 16 between 0 and 1024
+#endif
+#else
+#error FAST_BIN_MAX_SIZE is not defined...
+#endif
+
+#ifndef HEAP_GROWTH_MIN_SIZE
+#error HEAP_GROWTH_MIN_SIZE is not defined...
+#endif
+
+#ifndef HEAP_GROWTH_PERCENT
+#error HEAP_GROWTH_PERCENT is not defined...
+#endif
+
+#ifdef HEAP_GROWTH_ALIGNMENT
+#if HEAP_GROWTH_ALIGNMENT < 0x10 || (HEAP_GROWTH_ALIGNMENT & (HEAP_GROWTH_ALIGNMENT - 1)) != 0
+#error HEAP_GROWTH_ALIGNMENT should be a power of two of at least 16
+#endif
+#else
+#error HEAP_GROWTH_ALIGNMENT is not defined...
+#endif
+
+#ifndef TRIM_THRESHOLD
+#error TRIM_THRESHOLD is not defined...
+#endif
+
+#ifndef MMAP_THRESHOLD
+#error MMAP_THRESHOLD is not defined...
+#endif
+
+#ifdef LARGE_BIN_TREE
+#if LARGE_BIN_TREE != TRUE && LARGE_BIN_TREE != FALSE
+#error LARGE_BIN_TREE should be TRUE or FALSE
+#endif
+#else
+#error LARGE_BIN_TREE is not defined...
+#endif
+
+#ifdef FREE_BLOCK_INDEX
+#if FREE_BLOCK_INDEX != SEGREGATED && FREE_BLOCK_INDEX != TLSF
+#error FREE_BLOCK_INDEX should be SEGREGATED or TLSF
+#endif
+#else
+#error FREE_BLOCK_INDEX is not defined...
+#endif
+
+#ifdef ARENA_COUNT
+#if ARENA_COUNT < 1 || ARENA_COUNT > 0xff
+#error ARENA_COUNT should be between 1 and 255
+#endif
+#else
+#error ARENA_COUNT is not defined...
+#endif
+
+#ifdef REMOTE_FREE_QUEUE
+#if REMOTE_FREE_QUEUE != TRUE && REMOTE_FREE_QUEUE != FALSE
+#error REMOTE_FREE_QUEUE should be TRUE or FALSE
+#endif
+#else
+#error REMOTE_FREE_QUEUE is not defined...
+#endif
+
+#ifdef COMPACT_METADATA
+#if COMPACT_METADATA != TRUE && COMPACT_METADATA != FALSE
+#error COMPACT_METADATA should be TRUE or FALSE
+#endif
+#else
+#error COMPACT_METADATA is not defined...
+#endif
+
+#ifdef ALLOC_BITMAP
+#if ALLOC_BITMAP != TRUE && ALLOC_BITMAP != FALSE
+#error ALLOC_BITMAP should be TRUE or FALSE
+#endif
+#else
+#error ALLOC_BITMAP is not defined...
+#endif
+
+#if COMPACT_METADATA == TRUE
+// A tag is 32 bits in the upper half of its word, the lower half is free for
+// the payload of the block before when it is allocated. Sizes of up to 2^29
+// words fit in a tag, so the heap is kept under 4 GiB, and free list links are
+// 32 bit offsets.
+typedef U32 Tag;
+#define HEAP_LIMIT ((size_t)1 << 32)
+#else
+typedef Word Tag;
+#define HEAP_LIMIT MAX_HEAP_SIZE
+#endif // COMPACT_METADATA
+
+#if FREE_BLOCK_INDEX == TLSF
+// Two-level segregated fit: every power of two range of block sizes is a
+// first level class split into TLSF_SL_COUNT equal second level classes. Sizes
+// below TLSF_LINEAR_SIZE words all live in first level 0, one class per size.
+#define TLSF_SL_LOG2 3
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_LINEAR_SIZE (2 * TLSF_SL_COUNT)
+
+// enough first level classes for a block as big as the whole heap...
+#define TLSF_FL_COUNT (37 - TLSF_SL_LOG2)
+static_assert(MAX_HEAP_SIZE / sizeof(Word) == (1ull << 37), "");
+static_assert(TLSF_SL_COUNT <= 32 && TLSF_FL_COUNT <= 64, "");
+
+#define FREE_LIST_COUNT (TLSF_FL_COUNT * TLSF_SL_COUNT)
+#define Free_List_Index TLSF_Binning
+#else
+#define FREE_LIST_COUNT FREE_TABLE_SIZE
+#define Free_List_Index Size_Get_Bin_Index
+#endif // FREE_BLOCK_INDEX
+
+#if SLAB_MAX_SIZE > 0
+// Small requests are served from slabs, pages carved out of the heap holding
+// objects of one size class each, objects don't have any header so the slab
+// header at the start of the page describes all of them.
+#define SLAB_PAGE_SIZE ((size_t)0x1000)
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / ALIGNMENT)
+
+typedef struct Slab
+{
+    // neighbours in the arena's list of slabs of this class with free objects...
+    struct Slab *prev;
+    struct Slab *next;
+    // objects freed back to the slab, linked through their first word...
+    Word *free;
+    U16 object_size;
+    U16 capacity;
+    U16 used;
+    // objects below this index have been handed out at least once...
+    U16 bump;
+} Slab;
+
+#define SLAB_HEADER_SIZE (2 * ALIGNMENT)
+static_assert(sizeof(Slab) <= SLAB_HEADER_SIZE, "");
+
+// One bit for every page of the heap in slab_pages[], set when the page is a
+// slab, this is how free and realloc tell slab objects apart from blocks.
+#define SLAB_PAGES_SIZE (HEAP_LIMIT / SLAB_PAGE_SIZE / 8)
+#endif // SLAB_MAX_SIZE
+
+#if FAST_BIN_MAX_SIZE > 0
+// Freed blocks of up to FAST_BIN_MAX_SIZE bytes stay marked allocated and are
+// pushed on a list for their size, linked through their first payload word,
+// for malloc to hand back as they are. They are only freed and coalesced for
+// real in a batch, once FAST_BIN_FLUSH_COUNT of them pile up, when malloc
+// finds nothing else that fits, or before a request of at least
+// FAST_BIN_FLUSH_SIZE bytes so they don't keep the heap from being trimmed.
+#define FAST_BIN_COUNT (FAST_BIN_MAX_SIZE / ALIGNMENT + 1)
+#define FAST_BIN_MAX_WORDS (FAST_BIN_MAX_SIZE / sizeof(Word) + 2)
+#define FAST_BIN_FLUSH_COUNT 0x100
+#define FAST_BIN_FLUSH_SIZE 0x400
+#endif // FAST_BIN_MAX_SIZE
+
+#if MMAP_THRESHOLD > 0
+// Requests of at least MMAP_THRESHOLD bytes get a mapping of their own outside
+// of the heap, the header at its start keeps every live mapping on a list so
+// M_Init() can unmap the ones a previous run leaked.
+typedef struct Mapping
+{
+    struct Mapping *prev;
+    struct Mapping *next;
+    // length of the whole mapping in bytes, header included...
+    size_t len;
+    Word unused;
+} Mapping;
+
+#define MAPPING_HEADER_SIZE (2 * ALIGNMENT)
+static_assert(sizeof(Mapping) == MAPPING_HEADER_SIZE, "");
+#endif // MMAP_THRESHOLD
+
+// An arena is an independent heap with its own free table, threads are bound
+// to one arena each so that they only contend with threads that share it.
+typedef struct Arena
+{
+    // the context the arena is part of...
+    M_Context *ctx;
+    Word *free_table[FREE_LIST_COUNT];
+#if FREE_BLOCK_INDEX == TLSF
+    // bit i is set when any list of first level class i is non-empty...
+    U64 fl_bitmap;
+    // bit j of sl_bitmap[i] is set when list j of first level class i is
+    // non-empty...
+    U32 sl_bitmap[TLSF_FL_COUNT];
+#endif // FREE_BLOCK_INDEX
+#if SLAB_MAX_SIZE > 0
+    // slabs that have at least one free object, by size class...
+    Slab *slab_partial[SLAB_CLASS_COUNT];
+    // empty slabs kept for the next slab of any class, linked through next...
+    Slab *slab_empty;
+#endif // SLAB_MAX_SIZE
+#if FAST_BIN_MAX_SIZE > 0
+    // freed blocks that are still marked allocated, by size...
+    Word *fast_bins[FAST_BIN_COUNT];
+    size_t fast_count;
+#endif // FAST_BIN_MAX_SIZE
+#if ARENA_COUNT > 1
+    pthread_mutex_t lock;
+    // one word past the end boundary tag of the last chunk this arena grew,
+    // used to extend that chunk in place when nobody else grew after it...
+    Word *chunk_end;
+#if REMOTE_FREE_QUEUE == TRUE
+    // blocks freed by threads bound to other arenas, still marked allocated
+    // and linked through their first payload word, and about how many...
+    _Atomic(Word *) remote_free;
+    atomic_size_t remote_count;
+#endif // REMOTE_FREE_QUEUE
+#endif // ARENA_COUNT
+} Arena;
+
+#if FREE_BLOCK_INDEX == SEGREGATED
+static_assert(sizeof(((Arena *)NULL)->free_table) <= 128, "");
+#endif // FREE_BLOCK_INDEX
+
+#if ARENA_COUNT > 1
+// With multiple arenas the heap is handed out in chunks of this many bytes,
+// every chunk starts with its own boundary tags and belongs to one arena. The
+// heap grows by as many chunks as the growth options of config.h ask for, so a
+// chunk is only as big as HEAP_GROWTH_ALIGNMENT, and at least a page to keep
+// chunk_owner[] small.
+#if HEAP_GROWTH_ALIGNMENT > 0x1000
+#define ARENA_CHUNK_SIZE ((size_t)HEAP_GROWTH_ALIGNMENT)
+#else
+#define ARENA_CHUNK_SIZE ((size_t)0x1000)
+#endif
+
+// Index of the arena owning every chunk of the heap in chunk_owner[], so any
+// pointer can be mapped back to its arena without reading the block.
+#define CHUNK_OWNER_SIZE (HEAP_LIMIT / ARENA_CHUNK_SIZE)
+
+// The arena the thread is bound to and the context it belongs to, a thread
+// calling with another context is bound again to one of its arenas...
+static _Thread_local M_Context *thread_context = NULL;
+static _Thread_local Arena *thread_arena = NULL;
+
+// Blocks on the remote free queue of an arena past which the thread pushing
+// the next one drains the queue itself, unless the arena is busy.
+#define REMOTE_FREE_DRAIN_COUNT 0x100
+#endif // ARENA_COUNT
+
+// Everything the allocator keeps about one heap, M_Create() reserves it with
+// its tables and M_Init(...) sets it up on a simulated heap. The tables are
+// indexed from the start of the heap and only the part covering the heap is
+// touched.
+struct M_Context
+{
+    // the simulated heap, bound by M_Init(...)...
+    Heap_Sim *heap_sim;
+    // the start of the heap, offsets of mini block links are taken from here...
+    Word *heap_base;
+#if ALLOC_BITMAP == TRUE
+    U64 *alloc_bitmap;
+#endif // ALLOC_BITMAP
+#if SLAB_MAX_SIZE > 0
+    _Atomic(U64) *slab_pages;
+#endif // SLAB_MAX_SIZE
+#if MMAP_THRESHOLD > 0
+    Mapping *mappings;
+#if ARENA_COUNT > 1
+    // guards mappings, which is shared by all arenas...
+    pthread_mutex_t mapping_lock;
+#endif // ARENA_COUNT
+#endif // MMAP_THRESHOLD
+#if ARENA_COUNT > 1
+    // guards Heap_Sim_Sbrk(...) and chunk_owner[] which are shared by all
+    // arenas...
+    pthread_mutex_t heap_lock;
+    U8 *chunk_owner;
+    atomic_size_t next_arena;
+#endif // ARENA_COUNT
+    Arena arenas[ARENA_COUNT];
+};
+
+static bool Heap_Check(Arena *arena, size_t lineno);
+
+static size_t Linear_Binning(size_t block_size);
+static size_t Exponential_Binning(size_t block_size);
+static size_t Hybrid_Binning(size_t block_size);
+static size_t Range_Binning(size_t block_size);
+
+#if FREE_BLOCK_INDEX == TLSF
+static size_t TLSF_Binning(size_t block_size);
+#endif // FREE_BLOCK_INDEX
 
 // Returns whether the pointer is in the heap.
 // May be useful for debugging.
 static bool
-in_heap(const void *p)
+in_heap(M_Context *ctx, const void *p)
 {
-    return Heap_Sim_Get_Low() <= p && p <= Heap_Sim_Get_High();
+    return Heap_Sim_Get_Low(ctx->heap_sim) <= p && p <= Heap_Sim_Get_High(ctx->heap_sim);
 }
 
 // Get the printable string representation of a boolean.
@@ -102,126 +416,307 @@ static inline size_t
 Aligned_Word_Size(const size_t size_bytes)
 {
 #if MINI_BLOCK_OPTIMIZATION == TRUE
-    return MAX(align(size_bytes + sizeof(Word)) / sizeof(Word), MIN_BLOCK_SIZE);
+    return MAX(align(size_bytes + sizeof(Tag)) / sizeof(Word), MIN_BLOCK_SIZE);
 #else
-    return MAX(align(size_bytes + sizeof(Word)) / sizeof(Word), MIN_BLOCK_SIZE + 2);
+    return MAX(align(size_bytes + sizeof(Tag)) / sizeof(Word), MIN_BLOCK_SIZE + 2);
 #endif // MINI_BLOCK_OPTIMIZATION
 }
 
+// Number of bytes an allocated block of size words holds, the payload runs
+// from the word after the header up to the tag of the next block.
+static inline size_t
+Payload_Size(const size_t size)
+{
+    return size * sizeof(Word) - sizeof(Tag);
+}
+
+// A free block of MIN_BLOCK_SIZE has only one word after its header, so it
+// refers to its neighbours in the free list by their offsets from the start of
+// the heap in ALIGNMENT units instead of by pointers. The low bits of both
+// offsets share that word and the high bits go in the top byte of the header,
+// which tags don't use for anything else. Offset 0 stands for NULL. With
+// COMPACT_METADATA the offsets fit in the low bits alone, and every free block
+// links this way.
+#define MINI_LINK_LOW_BITS 32
+#if COMPACT_METADATA == TRUE
+#define MINI_LINK_HIGH_BITS 0
+#define MINI_LINK_TAG_MASK ((Tag)0)
+#else
+#define MINI_LINK_HIGH_BITS 4
+#define MINI_LINK_HIGH_SHIFT (WORD_SIZE_BITS - 2 * MINI_LINK_HIGH_BITS)
+#define MINI_LINK_TAG_MASK (~(((Word)1 << MINI_LINK_HIGH_SHIFT) - 1))
+#endif // COMPACT_METADATA
+static_assert(HEAP_LIMIT / ALIGNMENT <= (1ull << (MINI_LINK_LOW_BITS + MINI_LINK_HIGH_BITS)), "");
+
+#if ALLOC_BITMAP == TRUE
+// prev_alloc and prev_min of every block are two bits in alloc_bitmap[] instead
+// of bits of its header, a pair for every ALIGNMENT bytes from the start of the
+// heap. Headers are a word into their ALIGNMENT bytes so no two blocks share a
+// pair, and the pairs of two arenas never share a word since chunks are much
+// bigger than the 512 bytes a word covers. Only the part covering the heap is
+// touched.
+#define ALLOC_BITMAP_SIZE (HEAP_LIMIT / ALIGNMENT / 4)
+#endif // ALLOC_BITMAP
+
 // Make tag from metadata.
-static inline Word
+static inline Tag
 Tag_Pack(const size_t size, const bool alloc, const bool prev_alloc, const bool prev_min)
 {
     // TODO: footers only need to store size with with the footer optimization now
     // check the size can fit in the number of bits we have available...
-    dbg_assert(size < ((size_t)1 << (WORD_SIZE_BITS - 3)) - 1);
+#if COMPACT_METADATA == TRUE
+    dbg_assert(size < ((size_t)1 << 29));
+#else
+    dbg_assert(size < ((size_t)1 << (MINI_LINK_HIGH_SHIFT - 3)) - 1);
+#endif // COMPACT_METADATA
 
-    return (size << 3 | (Word)alloc << 2 | (Word)prev_alloc << 1 | (Word)prev_min);
+    return (Tag)(size << 3 | (Tag)alloc << 2 | (Tag)prev_alloc << 1 | (Tag)prev_min);
 }
 
 // Get size of block from a tag.
 static inline size_t
-Tag_Get_Size(const Word word)
+Tag_Get_Size(const Tag tag)
 {
-    const Word size = word >> 3;
+    const size_t size = (tag & ~MINI_LINK_TAG_MASK) >> 3;
     dbg_assert(size % 2 == 0);
     return size;
 }
 
 // Get allocation status of block from a tag.
 static inline bool
-Tag_Get_Alloc(const Word word)
+Tag_Get_Alloc(const Tag tag)
 {
-    return (word >> 2) & 1;
+    return (tag >> 2) & 1;
 }
 
 // Get previous block allocation status from a tag.
 static inline bool
-Tag_Get_Prev_Alloc(const Word word)
+Tag_Get_Prev_Alloc(const Tag tag)
 {
-    return (word >> 1) & 1;
+    return (tag >> 1) & 1;
 }
 
 // Get if previous block is a minimum sized block.
 static inline bool
-Tag_Get_Prev_Min(const Word word)
+Tag_Get_Prev_Min(const Tag tag)
+{
+    return (tag >> 0) & 1;
+}
+
+// Read the tag of a header or footer.
+static inline Tag
+Tag_Read(const Word *word)
+{
+#if COMPACT_METADATA == TRUE
+    Tag tag;
+    memcpy(&tag, (const U8 *)word + sizeof(Word) - sizeof(Tag), sizeof(tag));
+    return tag;
+#else
+    return word[0];
+#endif // COMPACT_METADATA
+}
+
+// Write the tag of a header or footer, with COMPACT_METADATA the rest of the
+// word may be the payload of the block before and is left alone.
+static inline void
+Tag_Write(Word *word, const Tag tag)
 {
-    return (word >> 0) & 1;
+#if COMPACT_METADATA == TRUE
+    memcpy((U8 *)word + sizeof(Word) - sizeof(Tag), &tag, sizeof(tag));
+#else
+    word[0] = tag;
+#endif // COMPACT_METADATA
 }
 
 // Get size of block, block is a pointer to start of the block.
 static inline size_t
 Block_Get_Size(const Word *block)
 {
-    return Tag_Get_Size(block[0]);
+    return Tag_Get_Size(Tag_Read(block));
 }
 
 // Get allocation status of block, block is a pointer to start of the block.
 static inline bool
 Block_Get_Alloc(const Word *block)
 {
-    return Tag_Get_Alloc(block[0]);
+    return Tag_Get_Alloc(Tag_Read(block));
+}
+
+#if ALLOC_BITMAP == TRUE
+// Index of the pair of bits of the block in alloc_bitmap[].
+static inline size_t
+Block_Get_Bitmap_Index(const Arena *arena, const Word *block)
+{
+    return (size_t)((const U8 *)block - (const U8 *)arena->ctx->heap_base) / ALIGNMENT;
+}
+
+// Get the prev_alloc and prev_min bits of the block from alloc_bitmap[], they
+// are laid out like in a tag.
+static inline Tag
+Block_Get_Prev_Bits(const Arena *arena, const Word *block)
+{
+    const size_t index = Block_Get_Bitmap_Index(arena, block);
+    return (Tag)(arena->ctx->alloc_bitmap[index / 32] >> (index % 32 * 2)) & 3;
+}
+
+// Set the prev_alloc and prev_min bits of the block in alloc_bitmap[].
+static inline void
+Block_Set_Prev_Bits(const Arena *arena, const Word *block, const bool prev_alloc, const bool prev_min)
+{
+    const size_t index = Block_Get_Bitmap_Index(arena, block);
+    const U64 bits = (U64)prev_alloc << 1 | (U64)prev_min;
+    U64 *word = &arena->ctx->alloc_bitmap[index / 32];
+    *word = (*word & ~((U64)3 << (index % 32 * 2))) | bits << (index % 32 * 2);
 }
+#endif // ALLOC_BITMAP
 
 // Get previous block allocation status from the block.
 static inline bool
-Block_Get_Prev_Alloc(const Word *block)
+Block_Get_Prev_Alloc(const Arena *arena, const Word *block)
 {
-    return Tag_Get_Prev_Alloc(block[0]);
+#if ALLOC_BITMAP == TRUE
+    return Tag_Get_Prev_Alloc(Block_Get_Prev_Bits(arena, block));
+#else
+    return Tag_Get_Prev_Alloc(Tag_Read(block));
+#endif // ALLOC_BITMAP
 }
 
 // Check if previous block is minimum sized block.
 static inline bool
-Block_Get_Prev_Min(const Word *block)
+Block_Get_Prev_Min(const Arena *arena, const Word *block)
 {
-    return Tag_Get_Prev_Min(block[0]);
+#if ALLOC_BITMAP == TRUE
+    return Tag_Get_Prev_Min(Block_Get_Prev_Bits(arena, block));
+#else
+    return Tag_Get_Prev_Min(Tag_Read(block));
+#endif // ALLOC_BITMAP
 }
 
-// Get free block in the free list, before block.
-// NOTE: caller should make sure that block size is not MIN_BLOCK_SIZE before
-// calling this function since those blocks don't store a prev pointer.
+// Number of words after the header of a free block used to link it into its
+// free list.
+#if COMPACT_METADATA == TRUE
+#define FREE_LINK_WORDS 1
+#else
+#define FREE_LINK_WORDS 2
+#endif // COMPACT_METADATA
+
+// Offset of the block from the start of the heap in ALIGNMENT units, 0 for NULL.
+static inline Word
+Mini_Link_Pack(const Arena *arena, const Word *block)
+{
+    if (block == NULL)
+    {
+        return 0;
+    }
+
+    dbg_assert(((U8 *)block - (U8 *)arena->ctx->heap_base) % ALIGNMENT == sizeof(Word));
+    return (Word)((U8 *)block - (U8 *)arena->ctx->heap_base) / ALIGNMENT + 1;
+}
+
+// Block at the given offset from the start of the heap, NULL for 0.
+static inline Word *
+Mini_Link_Unpack(const Arena *arena, const Word link)
+{
+    if (link == 0)
+    {
+        return NULL;
+    }
+
+    return (Word *)((U8 *)arena->ctx->heap_base + (link - 1) * ALIGNMENT) + 1;
+}
+
+// Get link i of a free mini block, 0 is the next block and 1 the previous one.
+static inline Word *
+Mini_Get_Link(const Arena *arena, const Word *block, const size_t i)
+{
+    const Word low_mask = ((Word)1 << MINI_LINK_LOW_BITS) - 1;
+    const Word low = (block[1] >> (i * MINI_LINK_LOW_BITS)) & low_mask;
+#if MINI_LINK_HIGH_BITS > 0
+    const Word high_mask = ((Word)1 << MINI_LINK_HIGH_BITS) - 1;
+    const Word high = (block[0] >> (MINI_LINK_HIGH_SHIFT + i * MINI_LINK_HIGH_BITS)) & high_mask;
+    return Mini_Link_Unpack(arena, high << MINI_LINK_LOW_BITS | low);
+#else
+    return Mini_Link_Unpack(arena, low);
+#endif // MINI_LINK_HIGH_BITS
+}
+
+// Set link i of a free mini block, 0 is the next block and 1 the previous one.
+static inline void
+Mini_Set_Link(const Arena *arena, Word *block, const size_t i, const Word *target)
+{
+    const Word link = Mini_Link_Pack(arena, target);
+    const Word low_mask = (((Word)1 << MINI_LINK_LOW_BITS) - 1) << (i * MINI_LINK_LOW_BITS);
+    block[1] = (block[1] & ~low_mask) | ((link << (i * MINI_LINK_LOW_BITS)) & low_mask);
+#if MINI_LINK_HIGH_BITS > 0
+    const Word high_mask = (((Word)1 << MINI_LINK_HIGH_BITS) - 1) << (MINI_LINK_HIGH_SHIFT + i * MINI_LINK_HIGH_BITS);
+    block[0] = (block[0] & ~high_mask) |
+               ((link >> MINI_LINK_LOW_BITS << (MINI_LINK_HIGH_SHIFT + i * MINI_LINK_HIGH_BITS)) & high_mask);
+#endif // MINI_LINK_HIGH_BITS
+}
+
+// Get link i of a free block, its next (0) or prev (1) pointer in its free
+// list, or its left (0) and right (1) child in a tree of free blocks.
 static inline Word *
-Block_Get_Prev_Free(const Word *block)
+Block_Get_Link(const Arena *arena, const Word *block, const size_t i)
 {
-    dbg_assert(Block_Get_Size(block) > MIN_BLOCK_SIZE);
+    if (COMPACT_METADATA == TRUE || Block_Get_Size(block) == MIN_BLOCK_SIZE)
+    {
+        return Mini_Get_Link(arena, block, i);
+    }
+
+    return (Word *)block[1 + i];
+}
+
+// Set link i of a free block, see Block_Get_Link(...).
+static inline void
+Block_Set_Link(const Arena *arena, Word *block, const size_t i, const Word *target)
+{
+    if (COMPACT_METADATA == TRUE || Block_Get_Size(block) == MIN_BLOCK_SIZE)
+    {
+        Mini_Set_Link(arena, block, i, target);
+        return;
+    }
+
+    block[1 + i] = (Word)target;
+}
 
-    return (Word *)block[2];
+// Get free block in the free list, before block.
+static inline Word *
+Block_Get_Prev_Free(const Arena *arena, const Word *block)
+{
+    return Block_Get_Link(arena, block, 1);
 }
 
 // Get free block in the free list, after block.
 static inline Word *
-Block_Get_Next_Free(const Word *block)
+Block_Get_Next_Free(const Arena *arena, const Word *block)
 {
-    return (Word *)block[1];
+    return Block_Get_Link(arena, block, 0);
 }
 
 // Set the prev pointer of the free block.
-// NOTE: caller should make sure that block size is not MIN_BLOCK_SIZE before
-// calling this function since those blocks don't store a prev pointer.
 static inline void
-Block_Set_Prev_Free(Word *block, const Word *prev)
+Block_Set_Prev_Free(const Arena *arena, Word *block, const Word *prev)
 {
-    dbg_assert(Block_Get_Size(block) > MIN_BLOCK_SIZE);
-
-    block[2] = (Word)prev;
+    Block_Set_Link(arena, block, 1, prev);
 }
 
 // Set the next pointer of the free block.
 static inline void
-Block_Set_Next_Free(Word *block, const Word *next)
+Block_Set_Next_Free(const Arena *arena, Word *block, const Word *next)
 {
-    block[1] = (Word)next;
+    Block_Set_Link(arena, block, 0, next);
 }
 
 // Get the block before the given block in the heap.
 // NOTE: caller should make sure previous block has a footer, i.e. is a
 // free block before calling this function.
 static inline Word *
-Block_Get_Prev_Adj(Word *block)
+Block_Get_Prev_Adj(const Arena *arena, Word *block)
 {
-    dbg_assert(Block_Get_Prev_Alloc(block) == false);
+    dbg_assert(Block_Get_Prev_Alloc(arena, block) == false);
 
-    const size_t prev_size = Block_Get_Prev_Min(block) ? MIN_BLOCK_SIZE : Tag_Get_Size(block[-1]);
+    const size_t prev_size = Block_Get_Prev_Min(arena, block) ? MIN_BLOCK_SIZE : Tag_Get_Size(Tag_Read(block - 1));
     return block - prev_size;
 }
 
@@ -232,427 +727,2371 @@ Block_Get_Next_Adj(Word *block)
     return block + Block_Get_Size(block);
 }
 
-// This function unlinks the given block from the free list, it assumes that
-// the block exists in the free list, and that its allocation status is set to
-// false.
-static void
-Block_Unlink_Free_List(const Word *block)
+// Whether the free list at bin_index is a tree sorted by size, with
+// LARGE_BIN_TREE that is the last bin which holds all the largest blocks.
+static inline bool
+Free_List_By_Size(const size_t bin_index)
 {
-    const size_t block_size = Block_Get_Size(block);
-    const size_t bin_index = Size_Get_Bin_Index(block_size);
-    Word **head = &free_table[bin_index];
-    dbg_assert(*head != NULL);
+#if LARGE_BIN_TREE == TRUE && FREE_BLOCK_INDEX == SEGREGATED
+    return bin_index == FREE_LIST_COUNT - 1;
+#else
+    (void)bin_index;
+    return false;
+#endif // LARGE_BIN_TREE
+}
 
-    Word *prev = NULL;
-    if (block_size == MIN_BLOCK_SIZE)
-    {
-        // block size is MIN_BLOCK_SIZE, so it doesn't hold prev pointer, we
-        // will have to traverse the entire list to get the previous block...
-        dbg_assert(bin_index == 0);
+// Whether the free list at bin_index is a tree rather than a linked list.
+static inline bool
+Free_List_Is_Tree(const size_t bin_index)
+{
+    return FREE_LIST_INSERT_STRATEGY == ADDRESS_ORDERED || Free_List_By_Size(bin_index);
+}
 
-        Word *curr = *head;
-        while (curr && curr != block)
-        {
-            prev = curr;
-            curr = Block_Get_Next_Free(curr);
-        }
+// Free lists that are trees are treaps of their blocks: a binary search tree
+// on the blocks, by address or by size and then address, that is also a heap on
+// a priority hashed from the address, which keeps it balanced in expectation
+// without storing anything besides the two children. The children take the
+// place of the next and prev pointers, so even mini blocks fit in a tree.
 
-        dbg_assert(curr != NULL);
-    }
-    else
+// Priority of the block in its tree, parents have higher priorities than
+// their children.
+static inline Word
+Free_Tree_Priority(const Word *block)
+{
+    // splitmix64 finalizer, block addresses alone are far from random...
+    Word x = (Word)block;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Whether block a comes before block b in a tree, by_size is set for trees
+// sorted by size.
+static inline bool
+Free_Tree_Before(const Word *a, const Word *b, const bool by_size)
+{
+    if (by_size && Block_Get_Size(a) != Block_Get_Size(b))
     {
-        // block size > MIN_BLOCK_SIZE, so we can get the stored prev
-        // pointer...
-        prev = Block_Get_Prev_Free(block);
+        return Block_Get_Size(a) < Block_Get_Size(b);
     }
 
-    Word *next = Block_Get_Next_Free(block);
+    return a < b;
+}
 
-    if (prev)
+// Make child the left (0) or right (1) child of parent, or the root of the
+// tree when parent is NULL.
+static inline void
+Free_Tree_Set_Child(const Arena *arena, Word **root, Word *parent, const size_t side, const Word *child)
+{
+    if (parent)
     {
-        Block_Set_Next_Free(prev, next);
+        Block_Set_Link(arena, parent, side, child);
     }
     else
     {
-        dbg_assert(*head == block);
-        *head = next;
-    }
-
-    if (next && Block_Get_Size(next) != MIN_BLOCK_SIZE)
-    {
-        Block_Set_Prev_Free(next, prev);
+        *root = (Word *)child;
     }
 }
 
-// Adds the provided block to the beginning of the free list.
-// NOTE: Normally, we never want to call this directly, only call it
-// through Block_Coalesce(...), unless we know that the prev and next
-// blocks are not free, for example during initialization of the heap.
+// Split the tree into the blocks before key and the blocks after it.
 static void
-Block_Insert_Free_List(Word *block)
+Free_Tree_Split(const Arena *arena, Word *tree, const Word *key, const bool by_size, Word **below, Word **above)
 {
-    // TODO: refactor this into a function...
-    const size_t block_size = Block_Get_Size(block);
-    const size_t bin_index = Size_Get_Bin_Index(block_size);
-    Word **head = &free_table[bin_index];
-
-#if FREE_LIST_INSERT_STRATEGY == ADDRESS_ORDERED
-    Word *prev = NULL;
-    Word *curr = *head;
-    while (curr && curr < block)
+    if (tree == NULL)
     {
-        prev = curr;
-        curr = Block_Get_Next_Free(curr);
+        *below = NULL;
+        *above = NULL;
     }
-
-    if (prev)
+    else if (Free_Tree_Before(tree, key, by_size))
     {
-        Block_Set_Next_Free(prev, block);
+        Word *right;
+        Free_Tree_Split(arena, Block_Get_Link(arena, tree, 1), key, by_size, &right, above);
+        Block_Set_Link(arena, tree, 1, right);
+        *below = tree;
     }
     else
     {
-        *head = block;
+        Word *left;
+        Free_Tree_Split(arena, Block_Get_Link(arena, tree, 0), key, by_size, below, &left);
+        Block_Set_Link(arena, tree, 0, left);
+        *above = tree;
     }
+}
 
-    Block_Set_Next_Free(block, curr);
-    if (Block_Get_Size(block) != MIN_BLOCK_SIZE)
+// Merge two trees where every block of below comes before every block of above.
+static Word *
+Free_Tree_Merge(const Arena *arena, Word *below, Word *above)
+{
+    if (below == NULL)
     {
-        Block_Set_Prev_Free(block, prev);
+        return above;
     }
 
-    if (curr && Block_Get_Size(curr) != MIN_BLOCK_SIZE)
+    if (above == NULL)
     {
-        Block_Set_Prev_Free(curr, block);
+        return below;
     }
-#elif FREE_LIST_INSERT_STRATEGY == FILO
-    if (Block_Get_Size(block) != MIN_BLOCK_SIZE)
+
+    if (Free_Tree_Priority(below) > Free_Tree_Priority(above))
     {
-        Block_Set_Prev_Free(block, NULL);
+        Block_Set_Link(arena, below, 1, Free_Tree_Merge(arena, Block_Get_Link(arena, below, 1), above));
+        return below;
     }
-    Block_Set_Next_Free(block, *head);
 
-    if (*head && Block_Get_Size(*head) != MIN_BLOCK_SIZE)
+    Block_Set_Link(arena, above, 0, Free_Tree_Merge(arena, below, Block_Get_Link(arena, above, 0)));
+    return above;
+}
+
+// Add the block to the tree, it takes the place of the first block on its
+// search path with a lower priority and the subtree there is split under it.
+static void
+Free_Tree_Insert(const Arena *arena, Word **root, Word *block, const bool by_size)
+{
+    const Word priority = Free_Tree_Priority(block);
+
+    Word *parent = NULL;
+    size_t side = 0;
+    Word *tree = *root;
+    while (tree && Free_Tree_Priority(tree) > priority)
     {
-        Block_Set_Prev_Free(*head, block);
+        parent = tree;
+        side = Free_Tree_Before(block, tree, by_size) ? 0 : 1;
+        tree = Block_Get_Link(arena, tree, side);
     }
 
-    *head = block;
-#else
-#error unknown FREE_LIST_INSERT_STRATEGY...
-#endif // ADDRESS_ORDERED_FREE_LIST
+    Word *below;
+    Word *above;
+    Free_Tree_Split(arena, tree, block, by_size, &below, &above);
+    Block_Set_Link(arena, block, 0, below);
+    Block_Set_Link(arena, block, 1, above);
+    Free_Tree_Set_Child(arena, root, parent, side, block);
 }
 
-// Refreshes next blocks knowledge of previous block's state.
-// TODO: can this me merged with Block_Coalesce(...)?
-// TODO: can this be eliminated with functions that can set header and footer
-// of blocks?
+// Remove the block from the tree, its children are merged into its place.
 static void
-Block_Inform_Next(Word *prev)
+Free_Tree_Remove(const Arena *arena, Word **root, const Word *block, const bool by_size)
 {
-    Word *next = Block_Get_Next_Adj(prev);
-    const size_t size = Block_Get_Size(next);
-    const size_t prev_size = Block_Get_Size(prev);
-    const bool alloc = Block_Get_Alloc(next);
-    const bool prev_alloc = Block_Get_Alloc(prev);
-    const bool prev_min = (prev_size == MIN_BLOCK_SIZE);
-    const Word tag = Tag_Pack(size, alloc, prev_alloc, prev_min);
-    next[0] = tag;
-    if (!alloc)
+    Word *parent = NULL;
+    size_t side = 0;
+    Word *tree = *root;
+    while (tree != block)
     {
-        next[size - 1] = tag;
+        dbg_assert(tree != NULL);
+
+        parent = tree;
+        side = Free_Tree_Before(block, tree, by_size) ? 0 : 1;
+        tree = Block_Get_Link(arena, tree, side);
     }
+
+    Word *merged = Free_Tree_Merge(arena, Block_Get_Link(arena, tree, 0), Block_Get_Link(arena, tree, 1));
+    Free_Tree_Set_Child(arena, root, parent, side, merged);
 }
 
-// Coalesce the block that is newly marked as free and add it to the free list.
+// Find the smallest block of at least size words in a tree sorted by size,
+// the lowest one of those if there are many, NULL if none is big enough.
 static Word *
-Block_Coalesce(Word *block)
+Free_Tree_Best_Fit(const Arena *arena, Word *tree, const size_t size)
 {
-    size_t size = Block_Get_Size(block);
-
-    Word *next = Block_Get_Next_Adj(block);
-    bool next_alloc = block == next || Block_Get_Alloc(next) == true;
-    if (!next_alloc)
+    Word *fit = NULL;
+    while (tree)
     {
-        size += Block_Get_Size(next);
-        Block_Unlink_Free_List(next);
+        if (Block_Get_Size(tree) >= size)
+        {
+            fit = tree;
+            tree = Block_Get_Link(arena, tree, 0);
+        }
+        else
+        {
+            tree = Block_Get_Link(arena, tree, 1);
+        }
     }
 
-    bool prev_alloc = Block_Get_Prev_Alloc(block);
-    bool prev_min = Block_Get_Prev_Min(block);
-    if (!prev_alloc)
+    return fit;
+}
+
+// Get the first block of the free list at bin_index, NULL if it is empty.
+static inline Word *
+Free_List_First(const Arena *arena, const size_t bin_index)
+{
+    Word *block = arena->free_table[bin_index];
+    if (Free_List_Is_Tree(bin_index))
     {
-        block = Block_Get_Prev_Adj(block);
-        prev_alloc = Block_Get_Prev_Alloc(block);
-        prev_min = Block_Get_Prev_Min(block);
-        size += Block_Get_Size(block);
-        Block_Unlink_Free_List(block);
+        // the first block is the leftmost one of the tree...
+        while (block && Block_Get_Link(arena, block, 0))
+        {
+            block = Block_Get_Link(arena, block, 0);
+        }
     }
 
-    const Word tag = Tag_Pack(size, false, prev_alloc, prev_min);
-    block[0] = tag;
-    block[size - 1] = tag;
-
-    Block_Insert_Free_List(block);
-
-    Block_Inform_Next(block);
-
     return block;
 }
 
-// Marks the block as free, coalesces and adds to the free list.
+// Get the block after block in the free list at bin_index, NULL at its end.
 static inline Word *
-Block_Free(Word *block, const size_t size, const bool prev_alloc, const bool prev_min)
+Free_List_Next(const Arena *arena, const size_t bin_index, const Word *block)
 {
-    const Word tag = Tag_Pack(size, false, prev_alloc, prev_min);
-    block[0] = tag;
-    block[size - 1] = tag;
-    return Block_Coalesce(block);
+    if (!Free_List_Is_Tree(bin_index))
+    {
+        return Block_Get_Next_Free(arena, block);
+    }
+
+    // the first block after this one, searched for from the root...
+    const bool by_size = Free_List_By_Size(bin_index);
+    Word *next = NULL;
+    Word *tree = arena->free_table[bin_index];
+    while (tree)
+    {
+        if (Free_Tree_Before(block, tree, by_size))
+        {
+            next = tree;
+            tree = Block_Get_Link(arena, tree, 0);
+        }
+        else
+        {
+            tree = Block_Get_Link(arena, tree, 1);
+        }
+    }
+
+    return next;
 }
 
-// This can be a newly unlinked or already allocated block.
-// Function assumes that block_size is the size of the block and allocates
-// alloc_size number of words.
-// Also spawns new free block if space is available.
-static void
-Block_Alloc(Word *block, const size_t block_size, const size_t alloc_size)
+// Record that the free list at bin_index has at least one block.
+static inline void
+Free_List_Mark_Non_Empty(Arena *arena, const size_t bin_index)
 {
-    const bool prev_alloc = Block_Get_Prev_Alloc(block);
-    const bool prev_min = Block_Get_Prev_Min(block);
-
-#if MINI_BLOCK_OPTIMIZATION == TRUE
-    if (block_size - alloc_size < MIN_BLOCK_SIZE)
-    {
+#if FREE_BLOCK_INDEX == TLSF
+    const size_t fl = bin_index / TLSF_SL_COUNT;
+    const size_t sl = bin_index % TLSF_SL_COUNT;
+    arena->sl_bitmap[fl] |= (U32)1 << sl;
+    arena->fl_bitmap |= (U64)1 << fl;
 #else
-    if (block_size - alloc_size < MIN_BLOCK_SIZE + 2)
-    {
-#endif // MINI_BLOCK_OPTIMIZATION
-        const Word tag = Tag_Pack(block_size, true, prev_alloc, prev_min);
-        block[0] = tag;
-        Block_Inform_Next(block);
-    }
-    else
+    (void)arena;
+    (void)bin_index;
+#endif // FREE_BLOCK_INDEX
+}
+
+// Record that the free list at bin_index has become empty.
+static inline void
+Free_List_Mark_Empty(Arena *arena, const size_t bin_index)
+{
+#if FREE_BLOCK_INDEX == TLSF
+    const size_t fl = bin_index / TLSF_SL_COUNT;
+    const size_t sl = bin_index % TLSF_SL_COUNT;
+    arena->sl_bitmap[fl] &= ~((U32)1 << sl);
+    if (arena->sl_bitmap[fl] == 0)
     {
-        const Word tag = Tag_Pack(alloc_size, true, prev_alloc, prev_min);
-        block[0] = tag;
-        Word *next = Block_Get_Next_Adj(block);
-        Block_Free(next, block_size - alloc_size, true, (alloc_size == MIN_BLOCK_SIZE));
+        arena->fl_bitmap &= ~((U64)1 << fl);
     }
+#else
+    (void)arena;
+    (void)bin_index;
+#endif // FREE_BLOCK_INDEX
 }
 
-// Raise the heap by size number of words and return the new free block it
-// created, the block is initialized and coalesced.
-static Word *
-Heap_Grow(size_t size)
+#if FREE_BLOCK_INDEX == TLSF
+// Find the head of the first non-empty free list at or after bin_index using
+// the occupancy bitmaps, NULL if there is none.
+static inline Word *
+TLSF_Find(const Arena *arena, const size_t bin_index)
 {
-    dbg_assert(size % 2 == 0);
-
-    Word *p = Heap_Sim_Sbrk(size * sizeof(Word));
-    if (p == NULL)
+    size_t fl = bin_index / TLSF_SL_COUNT;
+    const size_t sl = bin_index % TLSF_SL_COUNT;
+    if (fl >= TLSF_FL_COUNT)
     {
         return NULL;
     }
 
-    // set new heap end boundary tag...
-    Word *heapend = p + size - 1;
-    *heapend = Tag_Pack(0, true, false, size == MIN_BLOCK_SIZE);
+    // rest of this first level class...
+    U32 sl_map = arena->sl_bitmap[fl] & (~(U32)0 << sl);
+    if (sl_map == 0)
+    {
+        // otherwise the smallest non-empty class of a larger first level...
+        const U64 fl_map = arena->fl_bitmap & (~(U64)0 << (fl + 1));
+        if (fl_map == 0)
+        {
+            return NULL;
+        }
 
-    // set header and footer of new free block...
+        fl = __builtin_ctzll(fl_map);
+        sl_map = arena->sl_bitmap[fl];
+    }
+
+    return Free_List_First(arena, fl * TLSF_SL_COUNT + __builtin_ctz(sl_map));
+}
+#endif // FREE_BLOCK_INDEX
+
+// This function unlinks the given block from the free list, it assumes that
+// the block exists in the free list, and that its allocation status is set to
+// false.
+static void
+Block_Unlink_Free_List(Arena *arena, const Word *block)
+{
+    const size_t block_size = Block_Get_Size(block);
+    const size_t bin_index = Free_List_Index(block_size);
+    Word **head = &arena->free_table[bin_index];
+    dbg_assert(*head != NULL);
+
+    if (Free_List_Is_Tree(bin_index))
+    {
+        Free_Tree_Remove(arena, head, block, Free_List_By_Size(bin_index));
+    }
+    else
+    {
+        Word *prev = Block_Get_Prev_Free(arena, block);
+        Word *next = Block_Get_Next_Free(arena, block);
+
+        if (prev)
+        {
+            Block_Set_Next_Free(arena, prev, next);
+        }
+        else
+        {
+            dbg_assert(*head == block);
+            *head = next;
+        }
+
+        if (next)
+        {
+            Block_Set_Prev_Free(arena, next, prev);
+        }
+    }
+
+    if (*head == NULL)
+    {
+        Free_List_Mark_Empty(arena, bin_index);
+    }
+}
+
+// Adds the provided block to the beginning of the free list.
+// NOTE: Normally, we never want to call this directly, only call it
+// through Block_Coalesce(...), unless we know that the prev and next
+// blocks are not free, for example during initialization of the heap.
+static void
+Block_Insert_Free_List(Arena *arena, Word *block)
+{
+    // TODO: refactor this into a function...
+    const size_t block_size = Block_Get_Size(block);
+    const size_t bin_index = Free_List_Index(block_size);
+    Word **head = &arena->free_table[bin_index];
+
+    if (Free_List_Is_Tree(bin_index))
+    {
+        Free_Tree_Insert(arena, head, block, Free_List_By_Size(bin_index));
+    }
+    else
+    {
+        // FILO...
+        Block_Set_Prev_Free(arena, block, NULL);
+        Block_Set_Next_Free(arena, block, *head);
+
+        if (*head)
+        {
+            Block_Set_Prev_Free(arena, *head, block);
+        }
+
+        *head = block;
+    }
+
+    Free_List_Mark_Non_Empty(arena, bin_index);
+}
+
+// Refreshes next blocks knowledge of previous block's state.
+// TODO: can this me merged with Block_Coalesce(...)?
+// TODO: can this be eliminated with functions that can set header and footer
+// of blocks?
+static void
+Block_Inform_Next(const Arena *arena, Word *prev)
+{
+#if ALLOC_BITMAP == TRUE
+    // the next block isn't touched at all...
+    Block_Set_Prev_Bits(arena, Block_Get_Next_Adj(prev), Block_Get_Alloc(prev), Block_Get_Size(prev) == MIN_BLOCK_SIZE);
+#else
+    Word *next = Block_Get_Next_Adj(prev);
+    const size_t size = Block_Get_Size(next);
+    const size_t prev_size = Block_Get_Size(prev);
+    const bool alloc = Block_Get_Alloc(next);
+    const bool prev_alloc = Block_Get_Alloc(prev);
+    const bool prev_min = (prev_size == MIN_BLOCK_SIZE);
+    const Tag tag = Tag_Pack(size, alloc, prev_alloc, prev_min);
+    if (alloc)
+    {
+        Tag_Write(next, tag);
+    }
+    else if (size == MIN_BLOCK_SIZE)
+    {
+        // a free mini block has no footer, its links take the word after the
+        // header and the top byte of the header...
+        Tag_Write(next, tag | (Tag_Read(next) & MINI_LINK_TAG_MASK));
+    }
+    else
+    {
+        Tag_Write(next, tag);
+        Tag_Write(next + size - 1, tag);
+    }
+#endif // ALLOC_BITMAP
+}
+
+// Coalesce the block that is newly marked as free and add it to the free list.
+static Word *
+Block_Coalesce(Arena *arena, Word *block)
+{
+    size_t size = Block_Get_Size(block);
+
+    Word *next = Block_Get_Next_Adj(block);
+    bool next_alloc = block == next || Block_Get_Alloc(next) == true;
+    if (!next_alloc)
+    {
+        size += Block_Get_Size(next);
+        Block_Unlink_Free_List(arena, next);
+    }
+
+    bool prev_alloc = Block_Get_Prev_Alloc(arena, block);
+    bool prev_min = Block_Get_Prev_Min(arena, block);
+    if (!prev_alloc)
+    {
+        block = Block_Get_Prev_Adj(arena, block);
+        prev_alloc = Block_Get_Prev_Alloc(arena, block);
+        prev_min = Block_Get_Prev_Min(arena, block);
+        size += Block_Get_Size(block);
+        Block_Unlink_Free_List(arena, block);
+    }
+
+    const Tag tag = Tag_Pack(size, false, prev_alloc, prev_min);
+    Tag_Write(block, tag);
+    Tag_Write(block + size - 1, tag);
+
+    Block_Insert_Free_List(arena, block);
+
+    Block_Inform_Next(arena, block);
+
+    return block;
+}
+
+// Marks the block as free, coalesces and adds to the free list.
+static inline Word *
+Block_Free(Arena *arena, Word *block, const size_t size, const bool prev_alloc, const bool prev_min)
+{
+    const Tag tag = Tag_Pack(size, false, prev_alloc, prev_min);
+    Tag_Write(block, tag);
+    Tag_Write(block + size - 1, tag);
+#if ALLOC_BITMAP == TRUE
+    Block_Set_Prev_Bits(arena, block, prev_alloc, prev_min);
+#endif // ALLOC_BITMAP
+    return Block_Coalesce(arena, block);
+}
+
+// This can be a newly unlinked or already allocated block.
+// Function assumes that block_size is the size of the block and allocates
+// alloc_size number of words.
+// Also spawns new free block if space is available.
+static void
+Block_Alloc(Arena *arena, Word *block, const size_t block_size, const size_t alloc_size)
+{
+    const bool prev_alloc = Block_Get_Prev_Alloc(arena, block);
+    const bool prev_min = Block_Get_Prev_Min(arena, block);
+
+#if MINI_BLOCK_OPTIMIZATION == TRUE
+    if (block_size - alloc_size < MIN_BLOCK_SIZE)
+    {
+#else
+    if (block_size - alloc_size < MIN_BLOCK_SIZE + 2)
+    {
+#endif // MINI_BLOCK_OPTIMIZATION
+        Tag_Write(block, Tag_Pack(block_size, true, prev_alloc, prev_min));
+        Block_Inform_Next(arena, block);
+    }
+    else
+    {
+        Tag_Write(block, Tag_Pack(alloc_size, true, prev_alloc, prev_min));
+        Word *next = Block_Get_Next_Adj(block);
+        Block_Free(arena, next, block_size - alloc_size, true, (alloc_size == MIN_BLOCK_SIZE));
+    }
+}
+
+// Lock the arena, a no-op when there is only one arena.
+static inline void
+Arena_Lock(Arena *arena)
+{
+#if ARENA_COUNT > 1
+    pthread_mutex_lock(&arena->lock);
+#endif // ARENA_COUNT
+}
+
+// Unlock the arena, a no-op when there is only one arena.
+static inline void
+Arena_Unlock(Arena *arena)
+{
+#if ARENA_COUNT > 1
+    pthread_mutex_unlock(&arena->lock);
+#endif // ARENA_COUNT
+}
+
+// Get the arena the calling thread is bound to, threads are bound round-robin
+// the first time they allocate with the context.
+static inline Arena *
+Arena_Of_Thread(M_Context *ctx)
+{
+#if ARENA_COUNT > 1
+    if (thread_context != ctx)
+    {
+        thread_context = ctx;
+        thread_arena = &ctx->arenas[atomic_fetch_add(&ctx->next_arena, 1) % ARENA_COUNT];
+    }
+    return thread_arena;
+#else
+    return &ctx->arenas[0];
+#endif // ARENA_COUNT
+}
+
+// Get the arena that owns the block.
+static inline Arena *
+Arena_Of_Block(M_Context *ctx, const Word *block)
+{
+#if ARENA_COUNT > 1
+    const size_t offset = (const U8 *)block - (const U8 *)Heap_Sim_Get_Low(ctx->heap_sim);
+    return &ctx->arenas[ctx->chunk_owner[offset / ARENA_CHUNK_SIZE]];
+#else
+    return &ctx->arenas[0];
+#endif // ARENA_COUNT
+}
+
+#if SLAB_MAX_SIZE > 0
+// Get the index of the page containing p in slab_pages[].
+static inline size_t
+Slab_Page_Index(M_Context *ctx, const void *p)
+{
+    return ((const U8 *)p - (const U8 *)Heap_Sim_Get_Low(ctx->heap_sim)) / SLAB_PAGE_SIZE;
+}
+
+// Check if the pointer points into a slab.
+static inline bool
+Slab_Owns(M_Context *ctx, const void *p)
+{
+    const size_t index = Slab_Page_Index(ctx, p);
+    return (atomic_load_explicit(&ctx->slab_pages[index / 64], memory_order_relaxed) >> (index % 64)) & 1;
+}
+
+// Set or clear the slab bit of the page starting at slab.
+static inline void
+Slab_Page_Set(M_Context *ctx, const Slab *slab, const bool is_slab)
+{
+    const size_t index = Slab_Page_Index(ctx, slab);
+    const U64 bit = (U64)1 << (index % 64);
+    if (is_slab)
+    {
+        atomic_fetch_or_explicit(&ctx->slab_pages[index / 64], bit, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_and_explicit(&ctx->slab_pages[index / 64], ~bit, memory_order_relaxed);
+    }
+}
+
+// Clear the slab bits of every page overlapping size words starting at p.
+static void
+Slab_Pages_Clear(M_Context *ctx, const Word *p, const size_t size)
+{
+    const size_t last = Slab_Page_Index(ctx, p + size - 1);
+    size_t index = Slab_Page_Index(ctx, p);
+    while (index <= last)
+    {
+        // whole words of the bitmap at once when we can...
+        if (index % 64 == 0 && index + 64 <= last + 1)
+        {
+            atomic_store_explicit(&ctx->slab_pages[index / 64], 0, memory_order_relaxed);
+            index += 64;
+        }
+        else
+        {
+            const U64 bit = (U64)1 << (index % 64);
+            atomic_fetch_and_explicit(&ctx->slab_pages[index / 64], ~bit, memory_order_relaxed);
+            index += 1;
+        }
+    }
+}
+#endif // SLAB_MAX_SIZE
+
+// Number of bytes to raise the heap by when want bytes are needed at its end,
+// following the growth policy of config.h, so that the new end of the heap is
+// a multiple of alignment bytes from its start. With multiple arenas, caller
+// holds heap_lock.
+static size_t
+Heap_Growth_Size(M_Context *ctx, const size_t want, const size_t alignment)
+{
+    const size_t heap_size = Heap_Sim_Get_Heap_Size(ctx->heap_sim);
+
+    size_t bytes = MAX(want, (size_t)HEAP_GROWTH_MIN_SIZE);
+    bytes = MAX(bytes, heap_size / 100 * HEAP_GROWTH_PERCENT);
+
+    const size_t end = (heap_size + bytes + alignment - 1) / alignment * alignment;
+    return end - heap_size;
+}
+
+// Raise the heap by at least size number of words, more if the growth policy
+// says so or to put the heap end on a multiple of alignment bytes, and return
+// the new free block it created, the block is initialized and coalesced. When
+// fresh isn't NULL it is set to where the never written memory in the block
+// starts, or NULL if there is none.
+static Word *
+Heap_Grow(Arena *arena, size_t size, const size_t alignment, Word **fresh)
+{
+    dbg_assert(size % 2 == 0);
+
+    M_Context *ctx = arena->ctx;
+
+#if ARENA_COUNT > 1
+    pthread_mutex_lock(&ctx->heap_lock);
+
+    // if the last chunk of this arena is still at the end of the heap we
+    // can extend it just like the single arena case, otherwise we need a new
+    // chunk with its own boundary tags...
+    Word *heap_end = (Word *)((U8 *)Heap_Sim_Get_High(ctx->heap_sim) + 1);
+    const bool extend = arena->chunk_end == heap_end;
+    const size_t tags = extend ? 0 : 2;
+    const size_t want_bytes = (size + tags) * sizeof(Word);
+    const size_t chunk_bytes = Heap_Growth_Size(ctx, want_bytes, MAX(alignment, ARENA_CHUNK_SIZE));
+    size = chunk_bytes / sizeof(Word) - tags;
+
+    Word *clean = Heap_Sim_Get_Clean(ctx->heap_sim);
+    const bool fits = Heap_Sim_Get_Heap_Size(ctx->heap_sim) + chunk_bytes <= HEAP_LIMIT;
+    Word *p = fits ? Heap_Sim_Sbrk(ctx->heap_sim, chunk_bytes) : (void *)-1;
+    if (p == (void *)-1)
+    {
+        pthread_mutex_unlock(&ctx->heap_lock);
+        return NULL;
+    }
+
+    const size_t first = ((U8 *)p - (U8 *)Heap_Sim_Get_Low(ctx->heap_sim)) / ARENA_CHUNK_SIZE;
+    memset(&ctx->chunk_owner[first], (int)(arena - ctx->arenas), chunk_bytes / ARENA_CHUNK_SIZE);
+    arena->chunk_end = p + chunk_bytes / sizeof(Word);
+
+    pthread_mutex_unlock(&ctx->heap_lock);
+
+    if (!extend)
+    {
+        // same special tags as M_Init(...) sets up for the single arena...
+        Tag_Write(p, Tag_Pack(0, true, true, false));
+        Tag_Write(p + 1, Tag_Pack(0, true, true, false));
+#if ALLOC_BITMAP == TRUE
+        Block_Set_Prev_Bits(arena, p + 1, true, false);
+#endif // ALLOC_BITMAP
+        p += 2;
+    }
+#else
+    size = Heap_Growth_Size(ctx, size * sizeof(Word), MAX(alignment, (size_t)HEAP_GROWTH_ALIGNMENT)) / sizeof(Word);
+
+    Word *clean = Heap_Sim_Get_Clean(ctx->heap_sim);
+    const bool fits = Heap_Sim_Get_Heap_Size(ctx->heap_sim) + size * sizeof(Word) <= HEAP_LIMIT;
+    Word *p = fits ? Heap_Sim_Sbrk(ctx->heap_sim, size * sizeof(Word)) : (void *)-1;
+    if (p == (void *)-1)
+    {
+        return NULL;
+    }
+#endif // ARENA_COUNT
+
+    if (fresh)
+    {
+        *fresh = clean < p + size ? MAX(clean, p) : NULL;
+    }
+
+#if SLAB_MAX_SIZE > 0
+    // the new memory may be where slabs of a previous heap were...
+    Slab_Pages_Clear(ctx, p, size);
+#endif // SLAB_MAX_SIZE
+
+    // set new heap end boundary tag...
+    Word *heapend = p + size - 1;
+    Tag_Write(heapend, Tag_Pack(0, true, false, size == MIN_BLOCK_SIZE));
+
+    // set header and footer of new free block...
     Word *block = p - 1;
-    block = Block_Free(block, size, Block_Get_Prev_Alloc(block), Block_Get_Prev_Min(block));
+    block = Block_Free(arena, block, size, Block_Get_Prev_Alloc(arena, block), Block_Get_Prev_Min(arena, block));
+
+    return block;
+}
+
+#if TRIM_THRESHOLD > 0
+// Lower the heap to give back the free block at its end, returns false if the
+// block isn't at the end. Caller holds the lock.
+static bool
+Heap_Trim(Arena *arena, Word *block)
+{
+    const size_t size = Block_Get_Size(block);
+
+#if ARENA_COUNT > 1
+    pthread_mutex_lock(&arena->ctx->heap_lock);
+
+    Word *heap_end = (Word *)((U8 *)Heap_Sim_Get_High(arena->ctx->heap_sim) + 1);
+    if (block + size + 1 != heap_end)
+    {
+        pthread_mutex_unlock(&arena->ctx->heap_lock);
+        return false;
+    }
+
+    // the heap can only go back in whole chunks, so the new end boundary tag
+    // either takes the place of the block when that ends a chunk, or goes at
+    // the end of the first chunk that leaves room for a smaller free block...
+    const size_t chunk_words = ARENA_CHUNK_SIZE / sizeof(Word);
+    const size_t offset = block + 1 - (Word *)Heap_Sim_Get_Low(arena->ctx->heap_sim);
+    size_t end_offset = offset;
+    if (offset % chunk_words != 0)
+    {
+        const size_t keep = offset + Aligned_Word_Size(1);
+        end_offset = (keep + chunk_words - 1) / chunk_words * chunk_words;
+    }
+
+    Word *end = (Word *)Heap_Sim_Get_Low(arena->ctx->heap_sim) + end_offset;
+    if (end >= heap_end)
+    {
+        pthread_mutex_unlock(&arena->ctx->heap_lock);
+        return false;
+    }
+
+    Block_Unlink_Free_List(arena, block);
+    const bool prev_alloc = Block_Get_Prev_Alloc(arena, block);
+    const bool prev_min = Block_Get_Prev_Min(arena, block);
+    const size_t keep_size = end - 1 - block;
+    if (keep_size == 0)
+    {
+        Tag_Write(block, Tag_Pack(0, true, prev_alloc, prev_min));
+    }
+    else
+    {
+        Tag_Write(end - 1, Tag_Pack(0, true, false, keep_size == MIN_BLOCK_SIZE));
+#if ALLOC_BITMAP == TRUE
+        Block_Set_Prev_Bits(arena, end - 1, false, keep_size == MIN_BLOCK_SIZE);
+#endif // ALLOC_BITMAP
+        const Tag tag = Tag_Pack(keep_size, false, prev_alloc, prev_min);
+        Tag_Write(block, tag);
+        Tag_Write(block + keep_size - 1, tag);
+        Block_Insert_Free_List(arena, block);
+    }
+
+    arena->chunk_end = end;
+    Heap_Sim_Sbrk(arena->ctx->heap_sim, -(intptr_t)((heap_end - end) * sizeof(Word)));
+
+    pthread_mutex_unlock(&arena->ctx->heap_lock);
+#else
+    dbg_assert(Block_Get_Size(block + size) == 0);
+
+    // the end boundary tag takes the place of the block...
+    Block_Unlink_Free_List(arena, block);
+    Tag_Write(block, Tag_Pack(0, true, Block_Get_Prev_Alloc(arena, block), Block_Get_Prev_Min(arena, block)));
+    Heap_Sim_Sbrk(arena->ctx->heap_sim, -(intptr_t)(size * sizeof(Word)));
+#endif // ARENA_COUNT
+
+    return true;
+}
+
+// Give the memory of a free block of at least TRIM_THRESHOLD bytes back to the
+// OS, by lowering the heap when it is the last block, otherwise by discarding
+// the pages that don't hold its tags or free list links. Caller holds the lock.
+static void
+Block_Release(Arena *arena, Word *block)
+{
+    const size_t size = Block_Get_Size(block);
+    if (size * sizeof(Word) < TRIM_THRESHOLD)
+    {
+        return;
+    }
+
+    // the block is followed by an end boundary tag...
+    if (Block_Get_Size(block + size) == 0 && Heap_Trim(arena, block))
+    {
+        return;
+    }
+
+    Heap_Sim_Discard(arena->ctx->heap_sim, block + 1 + FREE_LINK_WORDS, (size - 2 - FREE_LINK_WORDS) * sizeof(Word));
+}
+#endif // TRIM_THRESHOLD
+
+#if MMAP_THRESHOLD > 0
+// Check if the pointer points into a mapping rather than the heap.
+static inline bool
+Mapping_Owns(M_Context *ctx, const void *p)
+{
+    return (size_t)((const U8 *)p - (const U8 *)Heap_Sim_Get_Low(ctx->heap_sim)) >= MAX_HEAP_SIZE;
+}
+
+// Get the mapping holding the payload at p.
+static inline Mapping *
+Mapping_Of(void *p)
+{
+    return (Mapping *)((U8 *)p - MAPPING_HEADER_SIZE);
+}
+
+// Add the mapping to the front of the list of live mappings.
+static void
+Mapping_Link(M_Context *ctx, Mapping *mapping)
+{
+#if ARENA_COUNT > 1
+    pthread_mutex_lock(&ctx->mapping_lock);
+#endif // ARENA_COUNT
+    mapping->prev = NULL;
+    mapping->next = ctx->mappings;
+    if (ctx->mappings)
+    {
+        ctx->mappings->prev = mapping;
+    }
+    ctx->mappings = mapping;
+#if ARENA_COUNT > 1
+    pthread_mutex_unlock(&ctx->mapping_lock);
+#endif // ARENA_COUNT
+}
+
+// Remove the mapping from the list of live mappings.
+static void
+Mapping_Unlink(M_Context *ctx, Mapping *mapping)
+{
+#if ARENA_COUNT > 1
+    pthread_mutex_lock(&ctx->mapping_lock);
+#endif // ARENA_COUNT
+    if (mapping->prev)
+    {
+        mapping->prev->next = mapping->next;
+    }
+    else
+    {
+        dbg_assert(ctx->mappings == mapping);
+        ctx->mappings = mapping->next;
+    }
+
+    if (mapping->next)
+    {
+        mapping->next->prev = mapping->prev;
+    }
+#if ARENA_COUNT > 1
+    pthread_mutex_unlock(&ctx->mapping_lock);
+#endif // ARENA_COUNT
+}
+
+// Allocate size bytes in a mapping of their own.
+static void *
+Mapping_Malloc(M_Context *ctx, const size_t size)
+{
+    const size_t len = MAPPING_HEADER_SIZE + size;
+    Mapping *mapping = Heap_Sim_Map(ctx->heap_sim, len);
+    if (!mapping)
+    {
+        return NULL;
+    }
+
+    mapping->len = len;
+    Mapping_Link(ctx, mapping);
+
+    return (U8 *)mapping + MAPPING_HEADER_SIZE;
+}
+
+// Unmap the mapping holding the payload at ptr, nothing is left behind in the
+// heap or the free lists.
+static void
+Mapping_Free(M_Context *ctx, void *ptr)
+{
+    Mapping *mapping = Mapping_Of(ptr);
+    Mapping_Unlink(ctx, mapping);
+    Heap_Sim_Unmap(ctx->heap_sim, mapping, mapping->len);
+}
+
+// Resize the mapping holding the payload at ptr to size bytes, the kernel
+// moves the pages instead of copying them when it can't grow in place.
+static void *
+Mapping_Realloc(M_Context *ctx, void *ptr, const size_t size)
+{
+    Mapping *mapping = Mapping_Of(ptr);
+    const size_t len = MAPPING_HEADER_SIZE + size;
+
+    Mapping_Unlink(ctx, mapping);
+    Mapping *new = Heap_Sim_Remap(ctx->heap_sim, mapping, mapping->len, len);
+    if (!new)
+    {
+        Mapping_Link(ctx, mapping);
+        return NULL;
+    }
+
+    new->len = len;
+    Mapping_Link(ctx, new);
+
+    return (U8 *)new + MAPPING_HEADER_SIZE;
+}
+
+// Unmap every mapping still live in the context, the ones the last run on its
+// heap leaked.
+static void
+Mapping_Free_All(M_Context *ctx)
+{
+    while (ctx->mappings)
+    {
+        Mapping *mapping = ctx->mappings;
+        ctx->mappings = mapping->next;
+        Heap_Sim_Unmap(ctx->heap_sim, mapping, mapping->len);
+    }
+}
+#endif // MMAP_THRESHOLD
+
+// Reserve one of the tables of a context, it reads as zero until written.
+static void *
+Table_Reserve(const size_t size)
+{
+    void *table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return table == MAP_FAILED ? NULL : table;
+}
+
+// Reserve a context and its tables, which stay for every heap it is set up on
+// after: returns NULL on error. Nothing is allocated with malloc, so this is
+// safe to call from the malloc of libmm.c.
+M_Context *
+M_Create(void)
+{
+    M_Context *ctx = mmap(NULL, sizeof(M_Context), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ctx == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    // the bits of a block, a page or a chunk are always set before they are
+    // read...
+    bool reserved = true;
+#if ALLOC_BITMAP == TRUE
+    ctx->alloc_bitmap = Table_Reserve(ALLOC_BITMAP_SIZE);
+    reserved = reserved && ctx->alloc_bitmap;
+#endif // ALLOC_BITMAP
+#if SLAB_MAX_SIZE > 0
+    ctx->slab_pages = Table_Reserve(SLAB_PAGES_SIZE);
+    reserved = reserved && ctx->slab_pages;
+#endif // SLAB_MAX_SIZE
+#if ARENA_COUNT > 1
+    ctx->chunk_owner = Table_Reserve(CHUNK_OWNER_SIZE);
+    reserved = reserved && ctx->chunk_owner;
+
+    pthread_mutex_init(&ctx->heap_lock, NULL);
+#if MMAP_THRESHOLD > 0
+    pthread_mutex_init(&ctx->mapping_lock, NULL);
+#endif // MMAP_THRESHOLD
+#endif // ARENA_COUNT
+
+    if (!reserved)
+    {
+        M_Release(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+// Unmap the context, its tables and the mappings still live in it, before
+// the heap it was set up on is released.
+void
+M_Release(M_Context *ctx)
+{
+#if MMAP_THRESHOLD > 0
+    Mapping_Free_All(ctx);
+#endif // MMAP_THRESHOLD
+    if (ctx->heap_sim)
+    {
+        Heap_Sim_Unclaim(ctx->heap_sim, ctx);
+    }
+
+#if ALLOC_BITMAP == TRUE
+    if (ctx->alloc_bitmap)
+    {
+        munmap(ctx->alloc_bitmap, ALLOC_BITMAP_SIZE);
+    }
+#endif // ALLOC_BITMAP
+#if SLAB_MAX_SIZE > 0
+    if (ctx->slab_pages)
+    {
+        munmap(ctx->slab_pages, SLAB_PAGES_SIZE);
+    }
+#endif // SLAB_MAX_SIZE
+#if ARENA_COUNT > 1
+    if (ctx->chunk_owner)
+    {
+        munmap(ctx->chunk_owner, CHUNK_OWNER_SIZE);
+    }
+#endif // ARENA_COUNT
+
+    munmap(ctx, sizeof(M_Context));
+}
+
+// Set the context up on top of the given heap, which every later call with it
+// allocates from until the next M_Init(...): returns false on error or when
+// another context is still set up on the heap, true on success.
+bool
+M_Init(M_Context *ctx, Heap_Sim *heap)
+{
+#if MMAP_THRESHOLD > 0
+    // the heap is starting over, so are the mappings, they belong to the
+    // heap the context was set up on until now...
+    Mapping_Free_All(ctx);
+#endif // MMAP_THRESHOLD
+
+    // two contexts on one heap would hand out the same memory, so the heap
+    // has to be free of any other context, and the one this context was set up
+    // on until now is free for others again...
+    if (!Heap_Sim_Claim(heap, ctx))
+    {
+        return false;
+    }
+    if (ctx->heap_sim && ctx->heap_sim != heap)
+    {
+        Heap_Sim_Unclaim(ctx->heap_sim, ctx);
+    }
+
+    ctx->heap_sim = heap;
+    ctx->heap_base = Heap_Sim_Get_Low(ctx->heap_sim);
+
+    // re-initialize the free_list_head to NULL in case M_Init() is called
+    // multiple times...
+    memset(ctx->arenas, 0, sizeof(ctx->arenas));
+    for (size_t i = 0; i < ARENA_COUNT; i += 1)
+    {
+        ctx->arenas[i].ctx = ctx;
+    }
+
+#if ARENA_COUNT > 1
+    // every arena sets up its own boundary tags when it grows its first chunk
+    // so there is nothing to put on the heap yet...
+    for (size_t i = 0; i < ARENA_COUNT; i += 1)
+    {
+        pthread_mutex_init(&ctx->arenas[i].lock, NULL);
+#if REMOTE_FREE_QUEUE == TRUE
+        atomic_init(&ctx->arenas[i].remote_free, NULL);
+        atomic_init(&ctx->arenas[i].remote_count, 0);
+#endif // REMOTE_FREE_QUEUE
+    }
+
+    return true;
+#else
+    // one word each for the special tags at start and end of the heap...
+    Word *heap_start = Heap_Sim_Sbrk(ctx->heap_sim, sizeof(Word) + sizeof(Word));
+    if (heap_start == (void *)-1)
+    {
+        return false;
+    }
+
+    dbg_assert(Heap_Sim_Get_Low(ctx->heap_sim) == heap_start);
+
+    Word *words = heap_start;
+
+    // special boundary tags at ends of the heap...
+    //
+    // size is 0, so Block_Get_Next_Adj and Block_Get_Prev_Adj of their
+    // neighbours yield themselves...
+    //
+    // alloc is set to true so they don't get coalesced...
+    //
+    // prev_alloc and prev_min are DON'T CARE at time of initialization since
+    // these bits don't make sense at beginning; when first block is allocated,
+    // they will be set to correct values...
+    Tag_Write(words, Tag_Pack(0, true, true, false));
+    Tag_Write(words + 1, Tag_Pack(0, true, true, false));
+#if ALLOC_BITMAP == TRUE
+    Block_Set_Prev_Bits(&ctx->arenas[0], words + 1, true, false);
+#endif // ALLOC_BITMAP
+
+    return true;
+#endif // ARENA_COUNT
+}
+
+// Mark the block of size words as free, coalesce it and give its memory back if
+// it is big enough. Caller holds the lock.
+static void
+Arena_Free_Block(Arena *arena, Word *block, const size_t size)
+{
+    block = Block_Free(arena, block, size, Block_Get_Prev_Alloc(arena, block), Block_Get_Prev_Min(arena, block));
+#if TRIM_THRESHOLD > 0
+    Block_Release(arena, block);
+#endif // TRIM_THRESHOLD
+}
+
+#if FAST_BIN_MAX_SIZE > 0
+// Free every block in the fast bins for real. Caller holds the lock.
+static void
+Arena_Flush_Fast_Bins(Arena *arena)
+{
+    for (size_t i = 0; i < FAST_BIN_COUNT; i += 1)
+    {
+        Word *block = arena->fast_bins[i];
+        while (block)
+        {
+            Word *next = (Word *)block[1];
+            Arena_Free_Block(arena, block, Block_Get_Size(block));
+            block = next;
+        }
+        arena->fast_bins[i] = NULL;
+    }
+    arena->fast_count = 0;
+}
+#endif // FAST_BIN_MAX_SIZE
+
+#if SLAB_MAX_SIZE > 0
+// Give every empty slab back to the heap. Caller holds the lock.
+static void
+Arena_Flush_Empty_Slabs(Arena *arena)
+{
+    Slab *slab = arena->slab_empty;
+    while (slab)
+    {
+        Slab *next = slab->next;
+        Slab_Page_Set(arena->ctx, slab, false);
+
+        Word *block = (Word *)slab - 1;
+        Arena_Free_Block(arena, block, Block_Get_Size(block));
+        slab = next;
+    }
+    arena->slab_empty = NULL;
+}
+#endif // SLAB_MAX_SIZE
+
+// Find a free block of at least aligned_size words in the arena, raise the
+// heap if allowed and nothing fits, and allocate it. When fresh isn't NULL it
+// is set like Heap_Grow(...) sets it if the block came from raising the heap,
+// and to NULL otherwise. Caller holds the lock.
+static Word *
+Arena_Malloc(Arena *arena, const size_t aligned_size, const bool grow, Word **fresh)
+{
+    if (fresh)
+    {
+        *fresh = NULL;
+    }
+
+    Heap_Check(arena, __LINE__);
+
+#if FAST_BIN_MAX_SIZE > 0
+    // a block of exactly this size freed recently is still marked allocated,
+    // so it is handed back as it is...
+    if (aligned_size <= FAST_BIN_MAX_WORDS && arena->fast_bins[aligned_size / 2 - 1])
+    {
+        Word *block = arena->fast_bins[aligned_size / 2 - 1];
+        arena->fast_bins[aligned_size / 2 - 1] = (Word *)block[1];
+        arena->fast_count -= 1;
+        return block;
+    }
+
+    if (aligned_size * sizeof(Word) >= FAST_BIN_FLUSH_SIZE && arena->fast_count > 0)
+    {
+        Arena_Flush_Fast_Bins(arena);
+    }
+#endif // FAST_BIN_MAX_SIZE
+
+#if FREE_BLOCK_INDEX == TLSF
+    // round the request up to the start of the next class, every block in a
+    // class at or above that fits so the head of the first non-empty list is
+    // taken without searching it...
+    size_t round_size = aligned_size;
+    if (aligned_size >= TLSF_LINEAR_SIZE)
+    {
+        const size_t msb = WORD_SIZE_BITS - 1 - __builtin_clzl(aligned_size);
+        round_size += ((size_t)1 << (msb - TLSF_SL_LOG2)) - 1;
+    }
+
+    Word *block = TLSF_Find(arena, TLSF_Binning(round_size));
+
+    // the head of the request's own class may still be big enough...
+    if (!block)
+    {
+        block = Free_List_First(arena, TLSF_Binning(aligned_size));
+        if (block && Block_Get_Size(block) < aligned_size)
+        {
+            block = NULL;
+        }
+    }
+#else
+    // keeps track of number of blocks searched...
+    size_t counter = 0;
+
+    // start with list that stores smallest sized blocks that can at least
+    // store this block...
+    size_t bin_index = Size_Get_Bin_Index(aligned_size);
+
+    // find first list that is not empty...
+    while (bin_index < FREE_LIST_COUNT && arena->free_table[bin_index] == NULL)
+    {
+        bin_index += 1;
+    }
+
+    Word *block = NULL;
+    if (bin_index < FREE_LIST_COUNT && Free_List_By_Size(bin_index))
+    {
+        // the largest blocks are sorted by size, so the best fit is found
+        // without searching...
+        block = Free_Tree_Best_Fit(arena, arena->free_table[bin_index], aligned_size);
+    }
+    else if (bin_index < FREE_LIST_COUNT)
+    {
+        block = Free_List_First(arena, bin_index);
+
+        // find first fit in the selected free list...
+        while (block && Block_Get_Size(block) < aligned_size)
+        {
+            dbg_assert(Block_Get_Alloc(block) == false);
+
+            counter += 1;
+            block = Free_List_Next(arena, bin_index, block);
+        }
+
+        Word *best_block = block;
+
+        // keep searching for a better fit in the same free list up to a limit...
+        while (block && Block_Get_Size(block) != aligned_size && counter < BEST_FIT_SEARCH_LIMIT)
+        {
+            dbg_assert(Block_Get_Alloc(block) == false);
+
+            counter += 1;
+
+            const size_t curr_size = Block_Get_Size(block);
+            const size_t best_size = Block_Get_Size(best_block);
+
+            if (aligned_size <= curr_size && curr_size < best_size)
+            {
+                best_block = block;
+            }
+
+            block = Free_List_Next(arena, bin_index, block);
+        }
+
+        block = best_block;
+    }
+#endif // FREE_BLOCK_INDEX
+
+    if (!block)
+    {
+#if FAST_BIN_MAX_SIZE > 0
+        // the blocks in the fast bins may coalesce into something that fits...
+        if (arena->fast_count > 0)
+        {
+            Arena_Flush_Fast_Bins(arena);
+            return Arena_Malloc(arena, aligned_size, grow, fresh);
+        }
+#endif // FAST_BIN_MAX_SIZE
+
+#if SLAB_MAX_SIZE > 0
+        // and so may the empty slabs...
+        if (arena->slab_empty)
+        {
+            Arena_Flush_Empty_Slabs(arena);
+            return Arena_Malloc(arena, aligned_size, grow, fresh);
+        }
+#endif // SLAB_MAX_SIZE
+
+        if (!grow)
+        {
+            return NULL;
+        }
+
+        // couldn't find any free block, need to raise heap...
+        block = Heap_Grow(arena, aligned_size, ALIGNMENT, fresh);
+        if (!block)
+        {
+            return NULL;
+        }
+    }
+
+    Block_Unlink_Free_List(arena, block);
+    Block_Alloc(arena, block, Block_Get_Size(block), aligned_size);
+
+    return block;
+}
+
+// Get the number of words between the block and the first block after it
+// whose payload is aligned to alignment bytes.
+static size_t
+Block_Align_Lead(const Word *block, const size_t alignment)
+{
+    // the padding before the aligned payload is split off as a free block so
+    // it must be big enough to be one...
+    const size_t min_free = Aligned_Word_Size(1);
+
+    const size_t payload = (size_t)(block + 1);
+    size_t lead = ((alignment - payload % alignment) % alignment) / sizeof(Word);
+    if (lead != 0 && lead < min_free)
+    {
+        lead += alignment / sizeof(Word);
+    }
+
+    return lead;
+}
+
+// Cut the allocated block down to aligned_size words whose payload is aligned
+// to alignment bytes, freeing the padding before it and whatever is left
+// after it, and return the aligned block. The block needs room for both, see
+// Block_Align_Lead(...). Caller holds the lock.
+static Word *
+Block_Align(Arena *arena, Word *block, const size_t aligned_size, const size_t alignment)
+{
+    const size_t lead = Block_Align_Lead(block, alignment);
+    dbg_assert(lead + aligned_size <= Block_Get_Size(block));
+
+    if (lead != 0)
+    {
+        // the aligned block starts after the padding, it is allocated and its
+        // prev bits are set when the padding is freed...
+        const size_t size = Block_Get_Size(block);
+        Word *aligned_block = block + lead;
+        Tag_Write(aligned_block, Tag_Pack(size - lead, true, false, false));
+        Block_Free(arena, block, lead, Block_Get_Prev_Alloc(arena, block), Block_Get_Prev_Min(arena, block));
+        block = aligned_block;
+    }
+
+    // give back whatever is left after the payload...
+    Block_Alloc(arena, block, Block_Get_Size(block), aligned_size);
+
+    return block;
+}
+
+// Like Arena_Malloc(...) but the payload of the returned block is aligned to
+// alignment bytes, a power of two multiple of ALIGNMENT. Caller holds the
+// lock.
+static Word *
+Arena_Malloc_Aligned(Arena *arena, const size_t aligned_size, const size_t alignment, const bool grow)
+{
+    // room for the longest padding Block_Align_Lead(...) can ask for...
+    const size_t min_free = Aligned_Word_Size(1);
+    const size_t alignment_words = alignment / sizeof(Word);
+
+    Word *block = Arena_Malloc(arena, aligned_size + alignment_words + min_free, grow, NULL);
+    if (!block)
+    {
+        return NULL;
+    }
+
+    return Block_Align(arena, block, aligned_size, alignment);
+}
+
+#if SLAB_MAX_SIZE > 0
+// Add the slab to the front of its class's list of slabs with free objects.
+static void
+Slab_Link(Arena *arena, Slab *slab)
+{
+    Slab **head = &arena->slab_partial[slab->object_size / ALIGNMENT - 1];
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head)
+    {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+// Remove the slab from its class's list of slabs with free objects.
+static void
+Slab_Unlink(Arena *arena, Slab *slab)
+{
+    Slab **head = &arena->slab_partial[slab->object_size / ALIGNMENT - 1];
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        dbg_assert(*head == slab);
+        *head = slab->next;
+    }
+
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Get a page aligned block for a new slab. The block is exactly a page long
+// so the header of the block after it is the last word of the page, which
+// lets slabs grown one after another tile the heap without any padding
+// between them. Caller holds the lock.
+static Word *
+Slab_Page_Alloc(Arena *arena, const bool grow)
+{
+    const size_t page_words = SLAB_PAGE_SIZE / sizeof(Word);
+
+    // empty slabs given back to the heap are page long blocks with an aligned
+    // payload, so the best fit for a page is likely one...
+    Word *block = Arena_Malloc(arena, page_words, false, NULL);
+    if (block && Block_Align_Lead(block, SLAB_PAGE_SIZE) != 0)
+    {
+        Arena_Free_Block(arena, block, Block_Get_Size(block));
+        block = Arena_Malloc_Aligned(arena, page_words, SLAB_PAGE_SIZE, false);
+    }
+
+    // rather than asking for a page more than needed to be sure to find an
+    // aligned one, raise the heap to a page boundary so the block at its end
+    // holds one as soon as it is long enough...
+    size_t missing = page_words;
+    while (!block && grow)
+    {
+        Word *top = Heap_Grow(arena, missing, SLAB_PAGE_SIZE, NULL);
+        if (!top)
+        {
+            return NULL;
+        }
+
+        const size_t top_size = Block_Get_Size(top);
+        if (Block_Align_Lead(top, SLAB_PAGE_SIZE) + page_words <= top_size)
+        {
+            Block_Unlink_Free_List(arena, top);
+            Block_Alloc(arena, top, top_size, top_size);
+            block = Block_Align(arena, top, page_words, SLAB_PAGE_SIZE);
+        }
+        else
+        {
+            missing = page_words + Aligned_Word_Size(1) - top_size;
+        }
+    }
+
+    return block;
+}
+
+// Start a new slab for objects of object_size bytes, on an empty slab if the
+// arena has one. Caller holds the lock.
+static Slab *
+Slab_New(Arena *arena, const size_t object_size, const bool grow)
+{
+    Slab *slab = arena->slab_empty;
+    if (slab)
+    {
+        arena->slab_empty = slab->next;
+    }
+    else
+    {
+        Word *block = Slab_Page_Alloc(arena, grow);
+        if (!block)
+        {
+            return NULL;
+        }
+
+        slab = (Slab *)(block + 1);
+        Slab_Page_Set(arena->ctx, slab, true);
+    }
+
+    slab->free = NULL;
+    slab->object_size = object_size;
+    slab->capacity = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE - sizeof(Word)) / object_size;
+    slab->used = 0;
+    slab->bump = 0;
+
+    Slab_Link(arena, slab);
+
+    return slab;
+}
+
+// Allocate an object of at most SLAB_MAX_SIZE bytes. Caller holds the lock.
+static void *
+Slab_Malloc(Arena *arena, const size_t size, const bool grow)
+{
+    const size_t class = (size - 1) / ALIGNMENT;
+
+    Slab *slab = arena->slab_partial[class];
+    if (!slab)
+    {
+        slab = Slab_New(arena, (class + 1) * ALIGNMENT, grow);
+        if (!slab)
+        {
+            return NULL;
+        }
+    }
+
+    // reuse freed objects first, then hand out ones never used before...
+    Word *object = slab->free;
+    if (object)
+    {
+        slab->free = (Word *)object[0];
+    }
+    else
+    {
+        object = (Word *)((U8 *)slab + SLAB_HEADER_SIZE + slab->bump * slab->object_size);
+        slab->bump += 1;
+    }
+
+    slab->used += 1;
+    if (slab->used == slab->capacity)
+    {
+        Slab_Unlink(arena, slab);
+    }
+
+    return object;
+}
+
+// Give an object back to its slab, and put the slab aside for any class when
+// it is empty. Caller holds the lock.
+static void
+Slab_Free(Arena *arena, Word *object)
+{
+    Slab *slab = (Slab *)((size_t)object & ~(SLAB_PAGE_SIZE - 1));
+
+    if (slab->used == slab->capacity)
+    {
+        Slab_Link(arena, slab);
+    }
+
+    object[0] = (Word)slab->free;
+    slab->free = object;
+    slab->used -= 1;
+
+    if (slab->used == 0)
+    {
+        Slab_Unlink(arena, slab);
+        slab->next = arena->slab_empty;
+        arena->slab_empty = slab;
+    }
+}
+#endif // SLAB_MAX_SIZE
+
+// Free the block of size words, which is not a slab object. Caller holds the
+// lock.
+static void
+Arena_Free_Sized(Arena *arena, Word *block, const size_t size)
+{
+    dbg_assert(size == Block_Get_Size(block));
+
+#if FAST_BIN_MAX_SIZE > 0
+    // keep small blocks as they are for the next malloc of the same size...
+    if (size <= FAST_BIN_MAX_WORDS)
+    {
+        block[1] = (Word)arena->fast_bins[size / 2 - 1];
+        arena->fast_bins[size / 2 - 1] = block;
+        arena->fast_count += 1;
+        if (arena->fast_count >= FAST_BIN_FLUSH_COUNT)
+        {
+            Arena_Flush_Fast_Bins(arena);
+        }
+        return;
+    }
+#endif // FAST_BIN_MAX_SIZE
+
+    Arena_Free_Block(arena, block, size);
+}
+
+// Free the block, or the slab object right after its would-be header. Caller
+// holds the lock.
+static void
+Arena_Free(Arena *arena, Word *block)
+{
+#if SLAB_MAX_SIZE > 0
+    if (Slab_Owns(arena->ctx, block + 1))
+    {
+        Slab_Free(arena, block + 1);
+        return;
+    }
+#endif // SLAB_MAX_SIZE
+
+    Arena_Free_Sized(arena, block, Block_Get_Size(block));
+}
+
+#if ARENA_COUNT > 1 && REMOTE_FREE_QUEUE == TRUE
+// Free every block on the arena's remote free queue in one batch, the queue is
+// taken with a single exchange so producers never wait on us. Caller holds the
+// lock.
+static void
+Arena_Drain_Remote_Frees(Arena *arena)
+{
+    if (atomic_load_explicit(&arena->remote_free, memory_order_relaxed) == NULL)
+    {
+        return;
+    }
+
+    atomic_store_explicit(&arena->remote_count, 0, memory_order_relaxed);
+    Word *block = atomic_exchange_explicit(&arena->remote_free, NULL, memory_order_acquire);
+    while (block)
+    {
+        Word *next = (Word *)block[1];
+        Arena_Free(arena, block);
+        block = next;
+    }
+}
+
+// Push a block (or slab object) freed by a thread that is not bound to its
+// arena onto the arena's remote free queue, this never touches the arena's
+// free lists or the block's neighbours so it doesn't need the arena lock. An
+// arena nobody allocates from any more would never drain its queue, so past
+// REMOTE_FREE_DRAIN_COUNT blocks the pusher drains it when the lock is free.
+static void
+Arena_Remote_Free(Arena *arena, Word *block)
+{
+    Word *head = atomic_load_explicit(&arena->remote_free, memory_order_relaxed);
+    do
+    {
+        // the block is still marked allocated, so link it through its first
+        // payload word as a plain pointer...
+        block[1] = (Word)head;
+    } while (!atomic_compare_exchange_weak_explicit(&arena->remote_free, &head, block, memory_order_release,
+                                                    memory_order_relaxed));
+
+    if (atomic_fetch_add_explicit(&arena->remote_count, 1, memory_order_relaxed) + 1 >= REMOTE_FREE_DRAIN_COUNT &&
+        pthread_mutex_trylock(&arena->lock) == 0)
+    {
+        Arena_Drain_Remote_Frees(arena);
+        Arena_Unlock(arena);
+    }
+}
+#endif // ARENA_COUNT && REMOTE_FREE_QUEUE
+
+// Allocate size bytes from the arena, from a slab when it's small enough.
+// fresh is set like Arena_Malloc(...) sets it. Caller holds the lock.
+static void *
+Arena_Alloc(Arena *arena, const size_t size, const bool grow, Word **fresh)
+{
+    *fresh = NULL;
+
+#if ARENA_COUNT > 1 && REMOTE_FREE_QUEUE == TRUE
+    Arena_Drain_Remote_Frees(arena);
+#endif // ARENA_COUNT && REMOTE_FREE_QUEUE
+
+#if SLAB_MAX_SIZE > 0
+    if (size <= SLAB_MAX_SIZE)
+    {
+        return Slab_Malloc(arena, size, grow);
+    }
+#endif // SLAB_MAX_SIZE
+
+    Word *block = Arena_Malloc(arena, Aligned_Word_Size(size), grow, fresh);
+    if (!block)
+    {
+        return NULL;
+    }
+
+    return block + 1;
+}
+
+// Split the allocated block into n blocks of size words each, except the last
+// one that takes whatever is left, and put their payloads in out[].
+static void
+Block_Split_Batch(const Arena *arena, Word *block, const size_t size, const size_t n, void **out)
+{
+    const size_t block_size = Block_Get_Size(block);
+    const bool prev_alloc = Block_Get_Prev_Alloc(arena, block);
+    const bool prev_min = Block_Get_Prev_Min(arena, block);
+
+    out[0] = block + 1;
+    for (size_t i = 1; i < n; i += 1)
+    {
+        Word *object = block + i * size;
+        const size_t object_size = i + 1 < n ? size : block_size - i * size;
+        Tag_Write(object, Tag_Pack(object_size, true, true, size == MIN_BLOCK_SIZE));
+#if ALLOC_BITMAP == TRUE
+        Block_Set_Prev_Bits(arena, object, true, size == MIN_BLOCK_SIZE);
+#endif // ALLOC_BITMAP
+        out[i] = object + 1;
+    }
+    Tag_Write(block, Tag_Pack(n > 1 ? size : block_size, true, prev_alloc, prev_min));
+
+    Block_Inform_Next(arena, block + (n - 1) * size);
+}
+
+// Allocate n objects of size bytes from the arena into out[], returns how many
+// it allocated. When one free block holds them all they are carved out of it,
+// so the free lists are searched and the block is split only once. Otherwise
+// the free blocks that fit one object are used up first and the heap is raised
+// once for the rest. Slab objects are taken one by one. Caller holds the lock.
+static size_t
+Arena_Alloc_Batch(Arena *arena, const size_t size, const size_t n, void **out)
+{
+#if ARENA_COUNT > 1 && REMOTE_FREE_QUEUE == TRUE
+    Arena_Drain_Remote_Frees(arena);
+#endif // ARENA_COUNT && REMOTE_FREE_QUEUE
+
+    size_t i = 0;
+
+#if SLAB_MAX_SIZE > 0
+    if (size <= SLAB_MAX_SIZE)
+    {
+        while (i < n && (out[i] = Slab_Malloc(arena, size, true)))
+        {
+            i += 1;
+        }
+        return i;
+    }
+#endif // SLAB_MAX_SIZE
+
+    const size_t aligned_size = Aligned_Word_Size(size);
+    if (n > MAX_HEAP_SIZE / sizeof(Word) / aligned_size)
+    {
+        return 0;
+    }
+
+    Word *block = Arena_Malloc(arena, n * aligned_size, false, NULL);
+    if (!block)
+    {
+        // raising the heap for all of them would leave the holes that fit
+        // one object unused...
+        while (i < n && (block = Arena_Malloc(arena, aligned_size, false, NULL)))
+        {
+            out[i] = block + 1;
+            i += 1;
+        }
+
+        if (i == n)
+        {
+            return n;
+        }
+
+        block = Arena_Malloc(arena, (n - i) * aligned_size, true, NULL);
+        if (!block)
+        {
+            return i;
+        }
+    }
+
+    Block_Split_Batch(arena, block, aligned_size, n - i, out + i);
+
+    return n;
+}
+
+// Allocate size bytes from the heap, from the calling thread's arena if it can
+// and any other arena otherwise. fresh is set like Arena_Malloc(...) sets it.
+static void *
+Heap_Alloc(M_Context *ctx, const size_t size, Word **fresh)
+{
+    Arena *arena = Arena_Of_Thread(ctx);
+
+    Arena_Lock(arena);
+    void *ptr = Arena_Alloc(arena, size, true, fresh);
+    Arena_Unlock(arena);
+
+#if ARENA_COUNT > 1
+    // the heap ran dry, fall back to whatever is left free in other arenas...
+    for (size_t i = 1; !ptr && i < ARENA_COUNT; i += 1)
+    {
+        Arena *other = &ctx->arenas[(arena - ctx->arenas + i) % ARENA_COUNT];
+
+        Arena_Lock(other);
+        ptr = Arena_Alloc(other, size, false, fresh);
+        Arena_Unlock(other);
+    }
+#endif // ARENA_COUNT
+
+    return ptr;
+}
+
+// Allocate size bytes aligned to alignment bytes, a power of two greater than
+// ALIGNMENT, from the arena. Caller holds the lock.
+static void *
+Arena_Alloc_Aligned(Arena *arena, const size_t size, const size_t alignment, const bool grow)
+{
+#if ARENA_COUNT > 1 && REMOTE_FREE_QUEUE == TRUE
+    Arena_Drain_Remote_Frees(arena);
+#endif // ARENA_COUNT && REMOTE_FREE_QUEUE
+
+    Word *block = Arena_Malloc_Aligned(arena, Aligned_Word_Size(size), alignment, grow);
+    if (!block)
+    {
+        return NULL;
+    }
+
+    return block + 1;
+}
+
+// Like Heap_Alloc(...) but the payload is aligned to alignment bytes, a power
+// of two greater than ALIGNMENT. The block never comes from a slab or a mapping
+// since neither is aligned past their own header.
+static void *
+Heap_Alloc_Aligned(M_Context *ctx, const size_t size, const size_t alignment)
+{
+    Arena *arena = Arena_Of_Thread(ctx);
+
+    Arena_Lock(arena);
+    void *ptr = Arena_Alloc_Aligned(arena, size, alignment, true);
+    Arena_Unlock(arena);
+
+#if ARENA_COUNT > 1
+    // the heap ran dry, fall back to whatever is left free in other arenas...
+    for (size_t i = 1; !ptr && i < ARENA_COUNT; i += 1)
+    {
+        Arena *other = &ctx->arenas[(arena - ctx->arenas + i) % ARENA_COUNT];
+
+        Arena_Lock(other);
+        ptr = Arena_Alloc_Aligned(other, size, alignment, false);
+        Arena_Unlock(other);
+    }
+#endif // ARENA_COUNT
+
+    return ptr;
+}
+
+#if FAST_BIN_MAX_SIZE > 0 && MMAP_THRESHOLD > 0
+// Flush the fast bins of the calling thread's arena before a request is given
+// a mapping, like Arena_Malloc(...) does before any big request.
+static void
+Heap_Flush_Fast_Bins(M_Context *ctx)
+{
+    Arena *arena = Arena_Of_Thread(ctx);
+
+    Arena_Lock(arena);
+    if (arena->fast_count > 0)
+    {
+        Arena_Flush_Fast_Bins(arena);
+    }
+    Arena_Unlock(arena);
+}
+#endif // FAST_BIN_MAX_SIZE && MMAP_THRESHOLD
+
+// malloc
+void *
+M_malloc(M_Context *ctx, const size_t size)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+#if MMAP_THRESHOLD > 0
+    if (size >= MMAP_THRESHOLD)
+    {
+#if FAST_BIN_MAX_SIZE > 0
+        Heap_Flush_Fast_Bins(ctx);
+#endif // FAST_BIN_MAX_SIZE
+        return Mapping_Malloc(ctx, size);
+    }
+#endif // MMAP_THRESHOLD
+
+    Word *fresh;
+    return Heap_Alloc(ctx, size, &fresh);
+}
+
+// calloc
+void *
+M_calloc(M_Context *ctx, const size_t nmemb, const size_t size)
+{
+    if (size != 0 && nmemb > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+
+    const size_t bytes = nmemb * size;
+    if (bytes == 0)
+    {
+        return NULL;
+    }
+
+#if MMAP_THRESHOLD > 0
+    if (bytes >= MMAP_THRESHOLD)
+    {
+#if FAST_BIN_MAX_SIZE > 0
+        Heap_Flush_Fast_Bins(ctx);
+#endif // FAST_BIN_MAX_SIZE
+        // new mappings are always zero...
+        return Mapping_Malloc(ctx, bytes);
+    }
+#endif // MMAP_THRESHOLD
+
+    Word *fresh;
+    U8 *ptr = Heap_Alloc(ctx, bytes, &fresh);
+    if (!ptr)
+    {
+        return NULL;
+    }
+
+    if (!fresh)
+    {
+        memset(ptr, 0, bytes);
+        return ptr;
+    }
+
+    // the block came from raising the heap, so from fresh on it was never
+    // written except for the free list links at the start of the block...
+    const size_t dirty = MAX((U8 *)fresh, ptr + FREE_LINK_WORDS * sizeof(Word)) - ptr;
+    memset(ptr, 0, MIN(dirty, bytes));
+
+    // ...and its footer when it wasn't split...
+    Word *block = (Word *)ptr - 1;
+    Word *footer = block + Block_Get_Size(block) - 1;
+    if ((U8 *)footer < ptr + bytes)
+    {
+        *footer = 0;
+    }
+
+    return ptr;
+}
+
+// Allocate n objects of size bytes into out[], returns how many it allocated,
+// fewer than n only when it ran out of memory.
+size_t
+M_malloc_batch(M_Context *ctx, const size_t size, const size_t n, void **out)
+{
+    if (size == 0 || n == 0)
+    {
+        return 0;
+    }
+
+    size_t count = 0;
+
+#if MMAP_THRESHOLD > 0
+    if (size < MMAP_THRESHOLD)
+#endif // MMAP_THRESHOLD
+    {
+        Arena *arena = Arena_Of_Thread(ctx);
+
+        Arena_Lock(arena);
+        count = Arena_Alloc_Batch(arena, size, n, out);
+        Arena_Unlock(arena);
+    }
+
+    // whatever didn't fit in one piece, or needs a mapping, one at a time...
+    for (; count < n; count += 1)
+    {
+        out[count] = M_malloc(ctx, size);
+        if (!out[count])
+        {
+            break;
+        }
+    }
+
+    return count;
+}
+
+// Free ptr, size is the size of its block in words if the caller knows it and 0
+// otherwise, in which case it is read from the header.
+static void
+Heap_Free(M_Context *ctx, void *ptr, const size_t size)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+#if MMAP_THRESHOLD > 0
+    if (Mapping_Owns(ctx, ptr))
+    {
+        Mapping_Free(ctx, ptr);
+        return;
+    }
+#endif // MMAP_THRESHOLD
+
+    // get the block pointer from the data pointer...
+    Word *block = (Word *)ptr - 1;
+    Arena *arena = Arena_Of_Block(ctx, block);
+
+#if ARENA_COUNT > 1 && REMOTE_FREE_QUEUE == TRUE
+    // leave blocks of other arenas to be freed by whoever allocates from them
+    // next instead of contending on their lock and free lists, a thread that
+    // only frees is bound to an arena here like it would be on malloc...
+    if (arena != Arena_Of_Thread(ctx))
+    {
+        Arena_Remote_Free(arena, block);
+        return;
+    }
+#endif // ARENA_COUNT && REMOTE_FREE_QUEUE
+
+    Arena_Lock(arena);
+    Heap_Check(arena, __LINE__);
+
+#if ARENA_COUNT > 1 && REMOTE_FREE_QUEUE == TRUE
+    // the owner drains its queue on free as well, for threads that mostly
+    // free what others allocated...
+    Arena_Drain_Remote_Frees(arena);
+#endif // ARENA_COUNT && REMOTE_FREE_QUEUE
+
+    // mark block as free and inform next adjacent block...
+    if (size == 0)
+    {
+        Arena_Free(arena, block);
+    }
+    else
+    {
+        Arena_Free_Sized(arena, block, size);
+    }
+    Arena_Unlock(arena);
+}
+
+// aligned_alloc, alignment has to be a power of two
+void *
+M_aligned_alloc(M_Context *ctx, const size_t alignment, const size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return NULL;
+    }
+
+    if (alignment <= ALIGNMENT)
+    {
+        return M_malloc(ctx, size);
+    }
+
+    if (size == 0 || size > MAX_HEAP_SIZE || alignment > MAX_HEAP_SIZE)
+    {
+        return NULL;
+    }
+
+    return Heap_Alloc_Aligned(ctx, size, alignment);
+}
+
+// memalign, alignment is rounded up to a power of two
+void *
+M_memalign(M_Context *ctx, const size_t alignment, const size_t size)
+{
+    size_t power = ALIGNMENT;
+    while (power < alignment && power <= MAX_HEAP_SIZE)
+    {
+        power <<= 1;
+    }
+
+    return M_aligned_alloc(ctx, power, size);
+}
+
+// free
+void
+M_free(M_Context *ctx, void *ptr)
+{
+    Heap_Free(ctx, ptr, 0);
+}
+
+// free_sized, size is what ptr was last allocated or reallocated with
+void
+M_free_sized(M_Context *ctx, void *ptr, const size_t size)
+{
+#if MINI_BLOCK_OPTIMIZATION == TRUE
+    // blocks are only ever split when at least MIN_BLOCK_SIZE is left over, so
+    // a block is exactly as big as its request and the header isn't needed to
+    // tell; slab objects are never bigger than SLAB_MAX_SIZE, so the slab
+    // lookup is skipped as well. Of the paths after that, a fast bin never
+    // loads the header, while Block_Free(...) still needs the prev_alloc and
+    // prev_min bits, which only ALLOC_BITMAP keeps out of the header. The
+    // size is checked against the header under DEBUG in
+    // Arena_Free_Sized(...)...
+    static_assert(ALIGNMENT == MIN_BLOCK_SIZE * sizeof(Word), "a split has to leave MIN_BLOCK_SIZE or nothing");
+    if (size > SLAB_MAX_SIZE)
+    {
+        Heap_Free(ctx, ptr, Aligned_Word_Size(size));
+        return;
+    }
+#endif // MINI_BLOCK_OPTIMIZATION
 
-    return block;
+    Heap_Free(ctx, ptr, 0);
 }
 
-// Initialize: returns false on error, true on success.
-bool
-M_Init(void)
+// Free the blocks (or slab objects) at the sorted pointers ptrs[] of the arena,
+// every run of blocks right next to each other in the heap is coalesced into
+// one free block at once. Caller holds the lock.
+static void
+Arena_Free_Batch(Arena *arena, void **ptrs, const size_t n)
 {
-    // one word each for the special tags at start and end of the heap...
-    Word *heap_start = Heap_Sim_Sbrk(sizeof(Word) + sizeof(Word));
-    if (heap_start == NULL)
+    size_t i = 0;
+    while (i < n)
     {
-        return false;
-    }
-
-    dbg_assert(Heap_Sim_Get_Low() == heap_start);
+        Word *block = (Word *)ptrs[i] - 1;
 
-    // re-initialize the free_list_head to NULL in case M_Init() is called
-    // multiple times...
-    memset(free_table, 0, sizeof(free_table));
+#if SLAB_MAX_SIZE > 0
+        if (Slab_Owns(arena->ctx, ptrs[i]))
+        {
+            Slab_Free(arena, ptrs[i]);
+            i += 1;
+            continue;
+        }
+#endif // SLAB_MAX_SIZE
 
-    Word *words = heap_start;
+        size_t size = Block_Get_Size(block);
+        size_t end = i + 1;
+        while (end < n && (Word *)ptrs[end] - 1 == block + size)
+        {
+            size += Block_Get_Size(block + size);
+            end += 1;
+        }
 
-    // special boundary tags at ends of the heap...
-    //
-    // size is 0, so Block_Get_Next_Adj and Block_Get_Prev_Adj of their
-    // neighbours yield themselves...
-    //
-    // alloc is set to true so they don't get coalesced...
-    //
-    // prev_alloc and prev_min are DON'T CARE at time of initialization since
-    // these bits don't make sense at beginning; when first block is allocated,
-    // they will be set to correct values...
-    words[0] = Tag_Pack(0, true, true, false);
-    words[1] = Tag_Pack(0, true, true, false);
+        if (end == i + 1)
+        {
+            Arena_Free(arena, block);
+        }
+        else
+        {
+            // the run is one allocated block as far as freeing it goes...
+            Arena_Free_Block(arena, block, size);
+        }
 
-    return true;
+        i = end;
+    }
 }
 
-// malloc
-void *
-M_malloc(const size_t size)
+// Compare two pointers by address for qsort(...).
+static int
+Pointer_Compare(const void *a, const void *b)
 {
-    Heap_Check(__LINE__);
+    const uintptr_t x = (uintptr_t)(*(void *const *)a);
+    const uintptr_t y = (uintptr_t)(*(void *const *)b);
+    return (x > y) - (x < y);
+}
 
-    if (size == 0)
+// Get the arena of a pointer returned by malloc, NULL if it is in a mapping.
+static inline Arena *
+Arena_Of_Pointer(M_Context *ctx, void *ptr)
+{
+#if MMAP_THRESHOLD > 0
+    if (Mapping_Owns(ctx, ptr))
     {
         return NULL;
     }
+#endif // MMAP_THRESHOLD
 
-    const size_t aligned_size = Aligned_Word_Size(size);
-
-    // keeps track of number of blocks searched...
-    size_t counter = 0;
+    return Arena_Of_Block(ctx, (Word *)ptr - 1);
+}
 
-    // start with list that stores smallest sized blocks that can at least
-    // store this block...
-    size_t bin_index = Size_Get_Bin_Index(aligned_size);
-    Word *block = free_table[bin_index];
+// Free the n pointers in ptrs[], which are sorted by address in the process.
+void
+M_free_batch(M_Context *ctx, void **ptrs, const size_t n)
+{
+    // in address order, neighbours in the heap are neighbours in ptrs[] and
+    // the pointers of one arena are all together...
+    qsort(ptrs, n, sizeof(*ptrs), Pointer_Compare);
 
-    // find first list that is not empty...
-    while (block == NULL && bin_index < FREE_TABLE_SIZE)
+    size_t i = 0;
+    while (i < n && !ptrs[i])
     {
-        block = free_table[bin_index];
-        bin_index += 1;
+        i += 1;
     }
 
-    // find first fit in the selected free list...
-    while (block && Block_Get_Size(block) < aligned_size)
+    while (i < n)
     {
-        dbg_assert(Block_Get_Alloc(block) == false);
-
-        counter += 1;
-        block = Block_Get_Next_Free(block);
-    }
+        Arena *arena = Arena_Of_Pointer(ctx, ptrs[i]);
+#if MMAP_THRESHOLD > 0
+        if (!arena)
+        {
+            Mapping_Free(ctx, ptrs[i]);
+            i += 1;
+            continue;
+        }
+#endif // MMAP_THRESHOLD
 
-    Word *best_block = block;
+        size_t end = i + 1;
+        while (end < n && Arena_Of_Pointer(ctx, ptrs[end]) == arena)
+        {
+            end += 1;
+        }
 
-    // keep searching for a better fit in the same free list up to a limit...
-    while (block && Block_Get_Size(block) != aligned_size && counter < BEST_FIT_SEARCH_LIMIT)
-    {
-        dbg_assert(Block_Get_Alloc(block) == false);
+        // the whole batch goes back at once, so even with REMOTE_FREE_QUEUE
+        // the blocks of other arenas are freed under their lock...
+        Arena_Lock(arena);
+        Heap_Check(arena, __LINE__);
+        Arena_Free_Batch(arena, ptrs + i, end - i);
+        Arena_Unlock(arena);
 
-        counter += 1;
+        i = end;
+    }
+}
 
-        const size_t curr_size = Block_Get_Size(block);
-        const size_t best_size = Block_Get_Size(best_block);
+// Resize the block without copying it elsewhere if possible: in place, by
+// raising the heap when the block is at its end, or by sliding the payload
+// back into a free block right before it. Returns the resized block, NULL if
+// none of these work. Caller holds the lock.
+static Word *
+Arena_Realloc_In_Place(Arena *arena, Word *block, const size_t aligned_size)
+{
+    Heap_Check(arena, __LINE__);
 
-        if (aligned_size <= curr_size && curr_size < best_size)
-        {
-            best_block = block;
-        }
+    const size_t old_size = Block_Get_Size(block);
 
-        block = Block_Get_Next_Free(block);
+    if (aligned_size == old_size)
+    {
+        return block;
     }
 
-    block = best_block;
+    if (aligned_size < old_size)
+    {
+        // we are shrinking (or maintaining) block size...
+        Block_Alloc(arena, block, Block_Get_Size(block), aligned_size);
+        return block;
+    }
 
-    if (!block)
+    // we are expanding the block size...
+    Word *next = Block_Get_Next_Adj(block);
+    bool next_is_free = !Block_Get_Alloc(next);
+    size_t next_size = next_is_free ? Block_Get_Size(next) : 0;
+
+    // the block is the last one, or only a free block is after it, so raise
+    // the heap by what's missing and the new memory ends up right after it...
+    Word *last = next_is_free ? Block_Get_Next_Adj(next) : next;
+#if ARENA_COUNT > 1
+    const bool at_end = Block_Get_Size(last) == 0 && last + 1 == arena->chunk_end;
+#else
+    const bool at_end = Block_Get_Size(last) == 0;
+#endif // ARENA_COUNT
+    if (next_size + old_size < aligned_size && at_end &&
+        Heap_Grow(arena, aligned_size - old_size - next_size, ALIGNMENT, NULL))
     {
-        // couldn't find any free block, need to raise heap...
-        block = Heap_Grow(aligned_size);
-        if (!block)
-        {
-            return NULL;
-        }
+        // with multiple arenas another one may have grown the heap in the
+        // meantime, so the new memory isn't necessarily adjacent...
+        next = Block_Get_Next_Adj(block);
+        next_is_free = !Block_Get_Alloc(next);
+        next_size = next_is_free ? Block_Get_Size(next) : 0;
     }
 
-    Block_Unlink_Free_List(block);
-    Block_Alloc(block, Block_Get_Size(block), aligned_size);
+    if (next_size + old_size >= aligned_size)
+    {
+        // we found a free block next to us and it has enough free space...
+        Block_Unlink_Free_List(arena, next);
+        Block_Alloc(arena, block, old_size + next_size, aligned_size);
+        return block;
+    }
 
-    return (Word *)block + 1;
-}
+    if (Block_Get_Prev_Alloc(arena, block))
+    {
+        return NULL;
+    }
 
-// free
-void
-M_free(void *ptr)
-{
-    Heap_Check(__LINE__);
+    Word *prev = Block_Get_Prev_Adj(arena, block);
+    const size_t prev_size = Block_Get_Size(prev);
+    if (prev_size + old_size + next_size < aligned_size)
+    {
+        return NULL;
+    }
 
-    if (!ptr)
+    // take the free blocks on both sides and move the payload to the start of
+    // the one before, the payload only grows so the copy is never overwritten
+    // by the tags of what is split off at the end...
+    Block_Unlink_Free_List(arena, prev);
+    if (next_size != 0)
     {
-        return;
+        Block_Unlink_Free_List(arena, next);
     }
 
-    // get the block pointer from the data pointer...
-    Word *block = (Word *)ptr - 1;
+    const size_t size = prev_size + old_size + next_size;
+    Tag_Write(prev, Tag_Pack(size, true, Block_Get_Prev_Alloc(arena, prev), Block_Get_Prev_Min(arena, prev)));
+    memmove(prev + 1, block + 1, Payload_Size(old_size));
+    Block_Alloc(arena, prev, size, aligned_size);
 
-    // mark block as free and inform next adjacent block...
-    Block_Free(block, Block_Get_Size(block), Block_Get_Prev_Alloc(block), Block_Get_Prev_Min(block));
+    return prev;
 }
 
 // realloc
 void *
-M_realloc(void *ptr, const size_t size)
+M_realloc(M_Context *ctx, void *ptr, const size_t size)
 {
-    Heap_Check(__LINE__);
-
     // if we are shrinking to 0 bytes, it is essentially just a call to free...
     if (size == 0)
     {
-        free(ptr);
+        M_free(ctx, ptr);
         return NULL;
     }
 
     // if ptr is NULL then this is essentially just a call to malloc...
     if (!ptr)
     {
-        return M_malloc(size);
+        return M_malloc(ctx, size);
     }
 
-    const size_t aligned_size = Aligned_Word_Size(size);
-
-    Word *block = (Word *)ptr - 1;
-    const size_t old_size = Block_Get_Size(block);
+    // number of bytes of the old allocation that need to be copied over...
+    size_t old_payload;
 
-    if (aligned_size == old_size)
+#if MMAP_THRESHOLD > 0
+    if (Mapping_Owns(ctx, ptr))
     {
-        return ptr;
-    }
+        // stays in a mapping of its own as long as it is big enough...
+        if (size >= MMAP_THRESHOLD)
+        {
+            return Mapping_Realloc(ctx, ptr, size);
+        }
 
-    if (aligned_size < old_size)
-    {
-        // we are shrinking (or maintaining) block size...
-        Block_Alloc(block, Block_Get_Size(block), aligned_size);
-        return ptr;
+        old_payload = Mapping_Of(ptr)->len - MAPPING_HEADER_SIZE;
     }
+    else
+#endif // MMAP_THRESHOLD
+#if SLAB_MAX_SIZE > 0
+    if (Slab_Owns(ctx, ptr))
+    {
+        // slab objects can't be resized, but the object may already be big
+        // enough...
+        const Slab *slab = (Slab *)((size_t)ptr & ~(SLAB_PAGE_SIZE - 1));
+        if (size <= slab->object_size)
+        {
+            return ptr;
+        }
 
-    // we are expanding the block size...
-    Word *next = Block_Get_Next_Adj(block);
-    const bool next_is_free = !Block_Get_Alloc(next);
-    size_t next_size = Block_Get_Size(next);
-
-    if (next_is_free && next_size + old_size >= aligned_size)
+        old_payload = slab->object_size;
+    }
+    else
+#endif // SLAB_MAX_SIZE
     {
-        // we found a free block next to us and it has enough free space...
-        Block_Unlink_Free_List(next);
-        Block_Alloc(block, old_size + next_size, aligned_size);
-        return ptr;
+        Word *block = (Word *)ptr - 1;
+        Arena *arena = Arena_Of_Block(ctx, block);
+        const size_t aligned_size = Aligned_Word_Size(size);
+
+        Arena_Lock(arena);
+        // copy only the payload, the word after it is the header of the next
+        // block which may be changing under another arena's lock...
+        old_payload = Payload_Size(Block_Get_Size(block));
+        Word *new_block = Arena_Realloc_In_Place(arena, block, aligned_size);
+        Arena_Unlock(arena);
+
+        if (new_block)
+        {
+            return new_block + 1;
+        }
     }
 
     // if nothing works, just do the dumb thing...
-    void *new = M_malloc(size);
+    void *new = M_malloc(ctx, size);
     if (!new)
     {
         return NULL;
     }
 
-    memcpy(new, ptr, old_size * sizeof(Word));
-    M_free(ptr);
+    memcpy(new, ptr, MIN(old_payload, size));
+    M_free(ctx, ptr);
 
     return new;
 }
 
+// Number of bytes the caller can use at ptr, at least as many as it asked for.
+size_t
+M_malloc_usable_size(M_Context *ctx, void *ptr)
+{
+    if (!ptr)
+    {
+        return 0;
+    }
+
+#if MMAP_THRESHOLD > 0
+    if (Mapping_Owns(ctx, ptr))
+    {
+        return Mapping_Of(ptr)->len - MAPPING_HEADER_SIZE;
+    }
+#endif // MMAP_THRESHOLD
+#if SLAB_MAX_SIZE > 0
+    if (Slab_Owns(ctx, ptr))
+    {
+        return ((Slab *)((size_t)ptr & ~(SLAB_PAGE_SIZE - 1)))->object_size;
+    }
+#endif // SLAB_MAX_SIZE
+
+    Word *block = (Word *)ptr - 1;
+    Arena *arena = Arena_Of_Block(ctx, block);
+
+    Arena_Lock(arena);
+    const size_t payload = Payload_Size(Block_Get_Size(block));
+    Arena_Unlock(arena);
+
+    return payload;
+}
+
+// Take every lock of the allocator, in the order the allocator nests them, so
+// that no other thread is halfway through a call, e.g. right before fork().
+void
+M_Lock_All(M_Context *ctx)
+{
+    for (size_t i = 0; i < ARENA_COUNT; i += 1)
+    {
+        Arena_Lock(&ctx->arenas[i]);
+    }
+#if ARENA_COUNT > 1
+    pthread_mutex_lock(&ctx->heap_lock);
+#if MMAP_THRESHOLD > 0
+    pthread_mutex_lock(&ctx->mapping_lock);
+#endif // MMAP_THRESHOLD
+#endif // ARENA_COUNT
+}
+
+// Release the locks taken by M_Lock_All().
+void
+M_Unlock_All(M_Context *ctx)
+{
+#if ARENA_COUNT > 1
+#if MMAP_THRESHOLD > 0
+    pthread_mutex_unlock(&ctx->mapping_lock);
+#endif // MMAP_THRESHOLD
+    pthread_mutex_unlock(&ctx->heap_lock);
+#endif // ARENA_COUNT
+    for (size_t i = ARENA_COUNT; i > 0; i -= 1)
+    {
+        Arena_Unlock(&ctx->arenas[i - 1]);
+    }
+}
+
 // Returns whether the pointer is aligned.
 // May be useful for debugging.
 static bool
@@ -665,7 +3104,7 @@ aligned(const void *p)
 #ifdef DEBUG // Block_Print(...)
 // Pretty prints a block, used by other debugging related functions.
 static void
-Block_Print(Word *block)
+Block_Print(const Arena *arena, Word *block)
 {
     if (!block)
     {
@@ -677,8 +3116,8 @@ Block_Print(Word *block)
     Word *word = block;
     const bool alloc = Block_Get_Alloc(block);
     const size_t size = Block_Get_Size(block);
-    const bool prev_alloc = Block_Get_Prev_Alloc(block);
-    const bool prev_min = Block_Get_Prev_Min(block);
+    const bool prev_alloc = Block_Get_Prev_Alloc(arena, block);
+    const bool prev_min = Block_Get_Prev_Min(arena, block);
 
     const char *fmt = "0x%016lx 0x%016lx 0x%016lx %-10s %-10s %-10s\n";
     dbg_printf(fmt, word, *word, size, Bool_Str(alloc), Bool_Str(prev_alloc), Bool_Str(prev_min));
@@ -686,30 +3125,39 @@ Block_Print(Word *block)
 #endif // Block_Print(...)
 
 // Pretty prints the entire heap.
-// I use this function to print the heap in gdb using `call Heap_Print()`.
+// I use this function to print the heap in gdb using `call Heap_Print(ctx)`.
 static void
-Heap_Print(void)
+Heap_Print(M_Context *ctx)
 {
 #ifdef DEBUG // Heap_Print(...)
-    Word *words = Heap_Sim_Get_Low();
-
-    dbg_assert(words[0] == Tag_Pack(0, true, true, false));
+    Word *words = Heap_Sim_Get_Low(ctx->heap_sim);
+    // blocks of every arena are printed the same, they only need the heap...
+    const Arena *arena = &ctx->arenas[0];
 
     dbg_printf("\nHeap start...\n");
 
-    Block_Print(NULL);
-
-    Block_Print(&words[0]);
+    Block_Print(arena, NULL);
 
-    Word *iter = &words[1];
-    while (iter != Block_Get_Next_Adj(iter))
+    // the heap is a sequence of chunks each enclosed by its own pair of
+    // special boundary tags, there is just one with a single arena...
+    while (words <= (Word *)Heap_Sim_Get_High(ctx->heap_sim))
     {
-        Block_Print(iter);
+        dbg_assert(Tag_Read(words) == Tag_Pack(0, true, true, false));
 
-        iter = Block_Get_Next_Adj(iter);
-    }
+        Block_Print(arena, &words[0]);
+
+        Word *iter = &words[1];
+        while (iter != Block_Get_Next_Adj(iter))
+        {
+            Block_Print(arena, iter);
+
+            iter = Block_Get_Next_Adj(iter);
+        }
+
+        Block_Print(arena, iter);
 
-    Block_Print(iter);
+        words = iter + 1;
+    }
 
     dbg_printf("heap end...\n\n");
 #endif // Heap_Print(...)
@@ -717,42 +3165,109 @@ Heap_Print(void)
 
 // Pretty prints the free list.
 // I use this function to print the free block list in gdb using `call
-// Free_List_Print()`.
+// Free_List_Print(&ctx->arenas[0])`.
 static void
-Free_List_Print(void)
+Free_List_Print(Arena *arena)
 {
 #ifdef DEBUG // Free_List_Print(...)
     dbg_printf("\nFree lists start...\n");
-    Block_Print(NULL);
-    for (size_t i = 0; i < FREE_TABLE_SIZE; i += 1)
+    Block_Print(arena, NULL);
+    for (size_t i = 0; i < FREE_LIST_COUNT; i += 1)
     {
-        Word *block = free_table[i];
+        Word *block = Free_List_First(arena, i);
 
         dbg_printf("list %zu...\n", i);
         while (block)
         {
-            Block_Print(block);
+            Block_Print(arena, block);
 
-            block = Block_Get_Next_Free(block);
+            block = Free_List_Next(arena, i, block);
         }
     }
     dbg_printf("Free lists end...\n\n");
 #endif // Free_List_Print(...)
 }
 
+#ifdef DEBUG_HEAPCHECKER
+// Checks the blocks of one chunk starting at its first block, counts its free
+// blocks into n_free and returns the end boundary tag of the chunk.
+static Word *
+Heap_Check_Chunk(const Arena *arena, Word *block, size_t lineno, size_t *n_free, bool *ret)
+{
+    Word *prev = NULL;
+    while (block != Block_Get_Next_Adj(block))
+    {
+        if (Block_Get_Alloc(block) == false)
+        {
+            *n_free += 1;
+            Word *next = Block_Get_Next_Adj(block);
+
+            // check that adjacent blocks are not free...
+            if (prev && Block_Get_Alloc(prev) == false)
+            {
+                *ret = false;
+                dbg_printf("line %zu: block at %p is free "
+                           "but one before it at %p is also free\n",
+                           lineno, (void *)block, (void *)prev);
+            }
+
+            // check that adjacent blocks are not free...
+            if (next != block && Block_Get_Alloc(next) == false)
+            {
+                *ret = false;
+                dbg_printf("line %zu: block at %p is free "
+                           "but one after it at %p is also free\n",
+                           lineno, (void *)block, (void *)next);
+            }
+        }
+
+        if (prev && Block_Get_Prev_Alloc(arena, block) != Block_Get_Alloc(prev))
+        {
+            *ret = false;
+            dbg_printf("line %zu: block %p has prev_alloc set to %d but previous block has alloc %d\n", lineno,
+                       (void *)block, Block_Get_Prev_Alloc(arena, block), Block_Get_Alloc(prev));
+        }
+
+        if (prev && Block_Get_Prev_Min(arena, block) != (Block_Get_Size(prev) == MIN_BLOCK_SIZE))
+        {
+            *ret = false;
+            dbg_printf("line %zu: block %p has prev_min set to %d but size of previous block is %zu\n", lineno,
+                       (void *)block, Block_Get_Prev_Min(arena, block), Block_Get_Size(prev));
+        }
+
+        prev = block;
+        block = Block_Get_Next_Adj(block);
+    }
+
+    return block;
+}
+#endif // DEBUG_HEAPCHECKER
+
 // Heap_Check
 bool
-Heap_Check(size_t lineno)
+Heap_Check(Arena *arena, size_t lineno)
 {
     bool ret = true;
 
 #ifdef DEBUG_HEAPCHECKER
+    M_Context *ctx = arena->ctx;
 
     size_t n_free = 0;
-    for (size_t i = 0; i < FREE_TABLE_SIZE; i += 1)
+    for (size_t i = 0; i < FREE_LIST_COUNT; i += 1)
     {
+#if FREE_BLOCK_INDEX == TLSF
+        // check the occupancy bitmaps agree with the lists...
+        const bool sl_bit = (arena->sl_bitmap[i / TLSF_SL_COUNT] >> (i % TLSF_SL_COUNT)) & 1;
+        const bool fl_bit = (arena->fl_bitmap >> (i / TLSF_SL_COUNT)) & 1;
+        if (sl_bit != (arena->free_table[i] != NULL) || (sl_bit && !fl_bit))
+        {
+            ret = false;
+            dbg_printf("line %zu: occupancy bitmap out of sync for list %zu\n", lineno, i);
+        }
+#endif // FREE_BLOCK_INDEX
+
         Word *prev = NULL;
-        Word *block = free_table[i];
+        Word *block = Free_List_First(arena, i);
         while (block)
         {
             n_free += 1;
@@ -760,87 +3275,132 @@ Heap_Check(size_t lineno)
             if (Block_Get_Alloc(block) == true)
             {
                 ret = false;
-                dbg_printf("line %d: block at %p is in free list "
+                dbg_printf("line %zu: block at %p is in free list "
                            "but marked as allocated\n",
-                           lineno, block);
+                           lineno, (void *)block);
+            }
+
+            if (Free_List_Is_Tree(i))
+            {
+                // check the tree is in order and a heap on priorities...
+                Word *left = Block_Get_Link(arena, block, 0);
+                Word *right = Block_Get_Link(arena, block, 1);
+                if ((prev && !Free_Tree_Before(prev, block, Free_List_By_Size(i))) ||
+                    (left && Free_Tree_Priority(left) > Free_Tree_Priority(block)) ||
+                    (right && Free_Tree_Priority(right) > Free_Tree_Priority(block)))
+                {
+                    ret = false;
+                    dbg_printf("line %zu: free tree out of order at block %p\n", lineno, (void *)block);
+                }
+            }
+            else if (Block_Get_Prev_Free(arena, block) != prev)
+            {
+                // prev and next pointers are inconsistent...
+                ret = false;
+                dbg_printf("line %zu: inconsistent prev pointer for block at %p\n", lineno, (void *)block);
             }
 
-            // check prev and next pointers are consistent...
-            if (Block_Get_Size(block) > MIN_BLOCK_SIZE && Block_Get_Prev_Free(block) != prev)
+            if (Free_List_Index(Block_Get_Size(block)) != i)
             {
                 ret = false;
-                dbg_printf("line %d: inconsistent prev pointer for block at %p\n", lineno, block);
+                dbg_printf("line %zu: %p has size %zu but is in bin %zu\n", lineno, (void *)block,
+                           Block_Get_Size(block), i);
             }
 
-            if (Size_Get_Bin_Index(Block_Get_Size(block)) != i)
+            if (Arena_Of_Block(arena->ctx, block) != arena)
             {
                 ret = false;
-                dbg_printf("line %d: %p has size %ld but is in bin %ld\n", lineno, block, Block_Get_Size(block), i);
+                dbg_printf("line %zu: block at %p is in the free list of another arena\n", lineno, (void *)block);
             }
 
             prev = block;
-            block = Block_Get_Next_Free(block);
+            block = Free_List_Next(arena, i, block);
         }
     }
 
-    size_t n_free2 = 0;
-    Word *prev = NULL;
-    Word *block = (Word *)Heap_Sim_Get_Low() + 1;
-    while (block != Block_Get_Next_Adj(block))
+#if FAST_BIN_MAX_SIZE > 0
+    // check blocks in the fast bins are still marked allocated and in the
+    // right bin...
+    size_t n_fast = 0;
+    for (size_t i = 0; i < FAST_BIN_COUNT; i += 1)
     {
-        if (Block_Get_Alloc(block) == false)
+        for (Word *block = arena->fast_bins[i]; block; block = (Word *)block[1])
         {
-            n_free2 += 1;
-            Word *next = Block_Get_Next_Adj(block);
-
-            // check that adjacent blocks are not free...
-            if (prev && Block_Get_Alloc(prev) == false)
+            n_fast += 1;
+            if (Block_Get_Alloc(block) == false || Block_Get_Size(block) / 2 - 1 != i)
             {
                 ret = false;
-                dbg_printf("line %d: block at %p is free "
-                           "but one before it at %p is also free\n",
-                           lineno, block, prev);
+                dbg_printf("line %zu: block at %p of size %zu is free or in the wrong fast bin %zu\n", lineno,
+                           (void *)block, Block_Get_Size(block), i);
             }
+        }
+    }
 
-            // check that adjacent blocks are not free...
-            if (next != block && Block_Get_Alloc(next) == false)
-            {
-                ret = false;
-                dbg_printf("line %d: block at %p is free "
-                           "but one after it at %p is also free\n",
-                           lineno, block, next);
-            }
+    if (n_fast != arena->fast_count)
+    {
+        ret = false;
+        dbg_printf("line %zu: found %zu blocks in the fast bins but counted %zu\n", lineno, n_fast, arena->fast_count);
+    }
+#endif // FAST_BIN_MAX_SIZE
+
+    size_t n_free2 = 0;
+
+#if ARENA_COUNT > 1
+    // walk every run of consecutive chunks this arena owns...
+    pthread_mutex_lock(&ctx->heap_lock);
+    const size_t num_chunks = Heap_Sim_Get_Heap_Size(ctx->heap_sim) / ARENA_CHUNK_SIZE;
+    const size_t index = arena - ctx->arenas;
+    for (size_t i = 0; i < num_chunks; i += 1)
+    {
+        if (ctx->chunk_owner[i] != index || (i > 0 && ctx->chunk_owner[i - 1] == index))
+        {
+            continue;
         }
 
-        if (prev && Block_Get_Prev_Min(block) != (Block_Get_Size(prev) == MIN_BLOCK_SIZE))
+        Word *chunk = (Word *)((U8 *)Heap_Sim_Get_Low(ctx->heap_sim) + i * ARENA_CHUNK_SIZE);
+        Word *block = Heap_Check_Chunk(arena, chunk + 1, lineno, &n_free2, &ret);
+
+        // check the end boundary tag is exactly at the end of the last chunk
+        // of the run...
+        size_t last = i;
+        while (last + 1 < num_chunks && ctx->chunk_owner[last + 1] == index)
         {
-            ret = false;
-            dbg_printf("line %d: block %p has prev_min set to %d but size of previous block is %ld\n", lineno, block,
-                       Block_Get_Prev_Min(block), Block_Get_Size(prev));
+            last += 1;
         }
 
-        prev = block;
-        block = Block_Get_Next_Adj(block);
+        const void *last_byte = (char *)block + 7;
+        const void *chunk_high = (U8 *)Heap_Sim_Get_Low(ctx->heap_sim) + (last + 1) * ARENA_CHUNK_SIZE - 1;
+        if (last_byte != chunk_high)
+        {
+            ret = false;
+            dbg_printf("line %zu: boundary tag is not exactly at the end "
+                       "of the chunk last byte is at %p but end of chunk is at %p\n",
+                       lineno, last_byte, chunk_high);
+        }
     }
+    pthread_mutex_unlock(&ctx->heap_lock);
+#else
+    Word *block = Heap_Check_Chunk(arena, (Word *)Heap_Sim_Get_Low(ctx->heap_sim) + 1, lineno, &n_free2, &ret);
 
     // check last byte of boundary tag is exactly at the end of the heap, this
     // should be enough to prove that all pointers before it are in the heap...
     const void *last_byte = (char *)block + 7;
-    if (last_byte != Heap_Sim_Get_High())
+    if (last_byte != Heap_Sim_Get_High(ctx->heap_sim))
     {
         ret = false;
-        dbg_printf("line %d: boundary tag is not exactly at the end "
+        dbg_printf("line %zu: boundary tag is not exactly at the end "
                    "of the heap last byte is at %p but end of heap is at %p\n",
-                   lineno, last_byte, Heap_Sim_Get_High());
+                   lineno, last_byte, Heap_Sim_Get_High(ctx->heap_sim));
     }
+#endif // ARENA_COUNT
 
     // check number of free blocks is consistent from free list and heap
     // iteration...
     if (n_free != n_free2)
     {
         ret = false;
-        dbg_printf("line %d: while traversing free list found %ld free blocks "
-                   ", but while traversing heap, found %ld free blocks\n",
+        dbg_printf("line %zu: while traversing free list found %zu free blocks "
+                   ", but while traversing heap, found %zu free blocks\n",
                    lineno, n_free, n_free2);
     }
 #endif // DEBUG_HEAPCHECKER
@@ -851,14 +3411,14 @@ Heap_Check(size_t lineno)
 // Below are some example binning stratgies set Size_Get_Bin_Index to whatever
 // binning strategy you want to use.
 
-size_t
+static size_t
 Linear_Binning(size_t block_size)
 {
     assert(block_size >= MIN_BLOCK_SIZE);
     return MIN((block_size - MIN_BLOCK_SIZE) / 2, FREE_TABLE_SIZE - 1);
 }
 
-size_t
+static size_t
 Exponential_Binning(size_t block_size)
 {
     assert(block_size >= MIN_BLOCK_SIZE);
@@ -880,7 +3440,7 @@ Exponential_Binning(size_t block_size)
     return bin;
 }
 
-size_t
+static size_t
 Hybrid_Binning(size_t block_size)
 {
     assert(block_size >= MIN_BLOCK_SIZE);
@@ -906,7 +3466,7 @@ Hybrid_Binning(size_t block_size)
     }
 }
 
-size_t
+static size_t
 Range_Binning(size_t block_size)
 {
     assert(block_size >= MIN_BLOCK_SIZE);
@@ -935,3 +3495,45 @@ Range_Binning(size_t block_size)
     // If no range matches, assign the last bin
     return MIN(NUM_BINS - 1, FREE_TABLE_SIZE - 1);
 }
+
+#if FREE_BLOCK_INDEX == TLSF
+// Free list of a block for the TLSF index: the first level class is the
+// position of the highest set bit, the second level class the next
+// TLSF_SL_LOG2 bits below it.
+static size_t
+TLSF_Binning(size_t block_size)
+{
+    assert(block_size >= MIN_BLOCK_SIZE);
+
+    if (block_size < TLSF_LINEAR_SIZE)
+    {
+        return block_size / 2;
+    }
+
+    const size_t msb = WORD_SIZE_BITS - 1 - __builtin_clzl(block_size);
+    const size_t fl = msb - TLSF_SL_LOG2;
+    const size_t sl = (block_size >> (msb - TLSF_SL_LOG2)) & (TLSF_SL_COUNT - 1);
+
+    return fl * TLSF_SL_COUNT + sl;
+}
+#endif // FREE_BLOCK_INDEX
+
+#ifdef MM_VARIANT
+const M_Allocator MM_VARIANT_NAME(M_Allocator) = {
+    .name = MM_VARIANT_STRING(MM_VARIANT),
+    .thread_safe = ARENA_COUNT > 1,
+    .create = M_Create,
+    .release = M_Release,
+    .init = M_Init,
+    .malloc = M_malloc,
+    .calloc = M_calloc,
+    .realloc = M_realloc,
+    .free = M_free,
+    .malloc_batch = M_malloc_batch,
+    .free_batch = M_free_batch,
+    .aligned_alloc = M_aligned_alloc,
+    .memalign = M_memalign,
+    .free_sized = M_free_sized,
+    .malloc_usable_size = M_malloc_usable_size,
+};
+#endif // MM_VARIANT
@@ -22,23 +22,76 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
-void *M_malloc(size_t size);
-void M_free(void *ptr);
-void *M_realloc(void *ptr, size_t size);
-void *M_calloc(size_t nmemb, size_t size);
-bool M_Init(void);
+#include "heapsim.h"
 
-#define MIN_BLOCK_SIZE 2
+// Everything the allocator keeps about one heap, so that several heaps can be
+// in use at once, e.g. one per replaying thread. Reserve one with M_Create(),
+// set it up on a heap with M_Init(...) and pass it to every call after.
+typedef struct M_Context M_Context;
+
+M_Context *M_Create(void);
+void M_Release(M_Context *ctx);
+bool M_Init(M_Context *ctx, Heap_Sim *heap);
+
+void *M_malloc(M_Context *ctx, size_t size);
+void M_free(M_Context *ctx, void *ptr);
+void *M_realloc(M_Context *ctx, void *ptr, size_t size);
+void *M_calloc(M_Context *ctx, size_t nmemb, size_t size);
+
+// Allocate n objects of size bytes next to each other into out[], returns how
+// many it allocated. Free the n pointers in ptrs[], sorting them by address.
+size_t M_malloc_batch(M_Context *ctx, size_t size, size_t n, void **out);
+void M_free_batch(M_Context *ctx, void **ptrs, size_t n);
+
+// Like C11 aligned_alloc, glibc memalign and C23 free_sized, the padding before
+// an aligned block is given back to the heap as a free block.
+void *M_aligned_alloc(M_Context *ctx, size_t alignment, size_t size);
+void *M_memalign(M_Context *ctx, size_t alignment, size_t size);
+void M_free_sized(M_Context *ctx, void *ptr, size_t size);
 
-size_t Linear_Binning(size_t block_size);
-size_t Exponential_Binning(size_t block_size);
-size_t Hybrid_Binning(size_t block_size);
-size_t Range_Binning(size_t block_size);
+// Like glibc malloc_usable_size, the bytes usable at ptr.
+size_t M_malloc_usable_size(M_Context *ctx, void *ptr);
+
+// Take and release every lock of the allocator, e.g. around fork() so the
+// child doesn't inherit a lock held by a thread that no longer exists.
+void M_Lock_All(M_Context *ctx);
+void M_Unlock_All(M_Context *ctx);
+
+// mm.c compiled with MM_VARIANT defined is one of several allocator variants
+// linked into the same binary, each with its own configuration. Its functions
+// get the variant's name as a suffix, e.g. M_malloc_Control, and are collected
+// in M_Allocator_Control; a context is only ever passed to the variant that
+// created it.
+typedef struct M_Allocator
+{
+    const char *name;
+    // can be called from many threads at once, it has more than one arena...
+    bool thread_safe;
+    M_Context *(*create)(void);
+    void (*release)(M_Context *ctx);
+    bool (*init)(M_Context *ctx, Heap_Sim *heap);
+    void *(*malloc)(M_Context *ctx, size_t size);
+    void *(*calloc)(M_Context *ctx, size_t nmemb, size_t size);
+    void *(*realloc)(M_Context *ctx, void *ptr, size_t size);
+    void (*free)(M_Context *ctx, void *ptr);
+    size_t (*malloc_batch)(M_Context *ctx, size_t size, size_t n, void **out);
+    void (*free_batch)(M_Context *ctx, void **ptrs, size_t n);
+    void *(*aligned_alloc)(M_Context *ctx, size_t alignment, size_t size);
+    void *(*memalign)(M_Context *ctx, size_t alignment, size_t size);
+    void (*free_sized)(M_Context *ctx, void *ptr, size_t size);
+    size_t (*malloc_usable_size)(M_Context *ctx, void *ptr);
+} M_Allocator;
+
+#define MIN_BLOCK_SIZE 2
 
 // use for defining FREE_LIST_INSERT_STRATEGY compile time value...
 #define FILO 0
 #define ADDRESS_ORDERED 1
 
+// use for defining FREE_BLOCK_INDEX compile time value...
+#define SEGREGATED 0
+#define TLSF 1
+
 // use for defining MINI_BLOCK_OPTIMIZATION compile time value...
 #define FALSE 0
 #define TRUE 1
@@ -25,7 +25,11 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include "perf.h"
 #include "defines.h"
@@ -37,13 +41,15 @@ Perf_Event_Open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_
 }
 
 int
-Perf_Start(const U64 type, const U64 config)
+Perf_Try_Start(const U64 type, const U64 config)
 {
     struct perf_event_attr pe = {
         .type = type,
         .size = sizeof(struct perf_event_attr),
         .config = config,
         .disabled = 1,
+        // threads started after the counter count towards it as well...
+        .inherit = 1,
         .exclude_kernel = 1,
         .exclude_hv = 1,
     };
@@ -51,8 +57,7 @@ Perf_Start(const U64 type, const U64 config)
     const int fd = Perf_Event_Open(&pe, 0, -1, -1, 0);
     if (fd == -1)
     {
-        fprintf(stderr, "Error opening leader %llx\n", pe.config);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     ioctl(fd, PERF_EVENT_IOC_RESET, 0);
@@ -61,6 +66,19 @@ Perf_Start(const U64 type, const U64 config)
     return fd;
 }
 
+int
+Perf_Start(const U64 type, const U64 config)
+{
+    const int fd = Perf_Try_Start(type, config);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error opening leader %llx\n", config);
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
 U64
 Perf_Stop(int fd)
 {
@@ -70,3 +88,216 @@ Perf_Stop(int fd)
     close(fd);
     return count;
 }
+
+// Open a counter that counts from now on in the group of group_fd, or as the
+// leader of a new group when group_fd is -1. The fd is -1 when the event
+// can't be opened.
+static Perf_Counter
+Perf_Counter_Open(const U64 type, const U64 config, const int group_fd)
+{
+    struct perf_event_attr pe = {
+        .type = type,
+        .size = sizeof(struct perf_event_attr),
+        .config = config,
+        // the leader starts the whole group once every member is in it...
+        .disabled = group_fd == -1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+        .read_format = PERF_FORMAT_GROUP,
+    };
+
+    Perf_Counter counter = {
+        .fd = Perf_Event_Open(&pe, 0, -1, group_fd, 0),
+        .page = NULL,
+    };
+    if (counter.fd == -1)
+    {
+        return counter;
+    }
+
+    // the first page of the counter's mapping tells whether it can be read
+    // with rdpmc and how, the ring buffer pages after it aren't needed...
+    void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, counter.fd, 0);
+    if (page != MAP_FAILED)
+    {
+        counter.page = page;
+    }
+
+    return counter;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline U64
+Perf_Rdpmc(const U32 index)
+{
+    U32 lo, hi;
+    __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index));
+    return (U64)hi << 32 | lo;
+}
+#endif
+
+// Read every counter of the group that can be read with rdpmc straight from
+// userspace, which takes tens of cycles each, marking them in rdpmc[]. They
+// are read back to back inside one retry loop over all their pages, so they
+// are all sampled at the same moment. The kernel doesn't allow it for some,
+// or the event isn't on a hardware counter right now, e.g. a software event.
+static void
+Perf_Group_Rdpmc(const Perf_Group *group, U64 *counts, bool *rdpmc)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    U32 seq[PERF_GROUP_MAX];
+    bool retry;
+    do
+    {
+        for (size_t i = 0; i < group->count; i += 1)
+        {
+            const volatile struct perf_event_mmap_page *page = group->counters[i].page;
+            seq[i] = page ? page->lock : 0;
+        }
+        __asm__ volatile("" ::: "memory");
+
+        for (size_t i = 0; i < group->count; i += 1)
+        {
+            const volatile struct perf_event_mmap_page *page = group->counters[i].page;
+            const U32 index = page ? page->index : 0;
+            rdpmc[i] = page && page->cap_user_rdpmc && index != 0;
+            if (!rdpmc[i])
+            {
+                continue;
+            }
+
+            // the kernel keeps the count up to when the counter was last
+            // scheduled in offset, the pmc holds what came since in its low
+            // pmc_width bits. The pmc starts at a negative value that offset
+            // is biased against, so it has to be sign extended...
+            const U32 shift = 64 - page->pmc_width;
+            const U64 pmc = (U64)((S64)(Perf_Rdpmc(index - 1) << shift) >> shift);
+            counts[i] = page->offset + pmc;
+        }
+
+        __asm__ volatile("" ::: "memory");
+        retry = false;
+        for (size_t i = 0; i < group->count; i += 1)
+        {
+            const volatile struct perf_event_mmap_page *page = group->counters[i].page;
+            retry = retry || (page && page->lock != seq[i]);
+        }
+    } while (retry);
+#else
+    for (size_t i = 0; i < group->count; i += 1)
+    {
+        rdpmc[i] = false;
+    }
+#endif
+}
+
+Perf_Group
+Perf_Group_Open(const Perf_Event *events, const size_t count)
+{
+    assert(count <= PERF_GROUP_MAX);
+
+    // the same events are opened for every run, so they are only reported
+    // the first time, by whichever thread gets there first...
+    static atomic_bool reported = false;
+    const bool report = !atomic_exchange(&reported, true);
+
+    Perf_Group group = {
+        .count = count,
+        .leader = -1,
+    };
+    for (size_t i = 0; i < count; i += 1)
+    {
+        group.counters[i] = Perf_Counter_Open(events[i].type, events[i].config, group.leader);
+        if (group.counters[i].fd == -1)
+        {
+            if (report)
+            {
+                fprintf(stderr, "Can't count %s, its columns will be 0\n", events[i].name);
+            }
+        }
+        else if (group.leader == -1)
+        {
+            group.leader = group.counters[i].fd;
+        }
+    }
+
+    if (group.leader != -1)
+    {
+        ioctl(group.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(group.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    return group;
+}
+
+// Current count of every counter of the group into counts[]. Counters that
+// can be read with rdpmc never leave userspace, the rest, e.g. software
+// events, all come from one read() of the leader right after, so a group of
+// only hardware events costs no system call at all. A group that mixes both
+// kinds samples them at two moments, the read() being apart from the rdpmc
+// by about the cost of the system call.
+void
+Perf_Group_Read(const Perf_Group *group, U64 *counts)
+{
+    bool rdpmc[PERF_GROUP_MAX];
+    for (size_t i = 0; i < group->count; i += 1)
+    {
+        counts[i] = 0;
+    }
+    Perf_Group_Rdpmc(group, counts, rdpmc);
+
+    bool all_rdpmc = true;
+    for (size_t i = 0; i < group->count; i += 1)
+    {
+        rdpmc[i] = rdpmc[i] || group->counters[i].fd == -1;
+        all_rdpmc = all_rdpmc && rdpmc[i];
+    }
+    if (all_rdpmc || group->leader == -1)
+    {
+        return;
+    }
+
+    // the leader reads as the number of counters opened followed by their
+    // counts in the order they joined the group...
+    U64 values[1 + PERF_GROUP_MAX] = { 0 };
+    read(group->leader, values, sizeof(values));
+    size_t k = 0;
+    for (size_t i = 0; i < group->count; i += 1)
+    {
+        if (group->counters[i].fd == -1)
+        {
+            continue;
+        }
+        if (!rdpmc[i])
+        {
+            counts[i] = values[1 + k];
+        }
+        k += 1;
+    }
+}
+
+void
+Perf_Group_Close(Perf_Group *group)
+{
+    if (group->leader != -1)
+    {
+        ioctl(group->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    // the followers go before the leader...
+    for (size_t i = group->count; i-- > 0;)
+    {
+        Perf_Counter *counter = &group->counters[i];
+        if (counter->page)
+        {
+            munmap((void *)counter->page, sysconf(_SC_PAGESIZE));
+        }
+        if (counter->fd != -1)
+        {
+            close(counter->fd);
+        }
+    }
+
+    group->count = 0;
+    group->leader = -1;
+}
@@ -24,4 +24,44 @@
 int Perf_Start(const U64 type, const U64 config);
 U64 Perf_Stop(int fd);
 
+// Most events Perf_Group_Open(...) counts together.
+#define PERF_GROUP_MAX 8
+
+// An event to count, name is what its CSV columns are called after.
+typedef struct Perf_Event
+{
+    const Char8 *name;
+    U64 type;
+    U64 config;
+} Perf_Event;
+
+// A counter that stays open and counting for a whole run, so that reading it
+// around an op doesn't open and close a counter every time.
+typedef struct Perf_Counter
+{
+    // -1 when the event couldn't be opened, it then always reads as 0...
+    int fd;
+    // the counter's page mapped from the kernel, NULL when it couldn't be
+    // mapped and the counter is only read with read()...
+    const volatile struct perf_event_mmap_page *page;
+} Perf_Counter;
+
+// Counters of several events scheduled together by the kernel, so they all
+// count over exactly the same instructions and are read at once.
+typedef struct Perf_Group
+{
+    size_t count;
+    Perf_Counter counters[PERF_GROUP_MAX];
+    // fd of the first counter that could be opened, -1 for none...
+    int leader;
+} Perf_Group;
+
+Perf_Group Perf_Group_Open(const Perf_Event *events, const size_t count);
+void Perf_Group_Read(const Perf_Group *group, U64 *counts);
+void Perf_Group_Close(Perf_Group *group);
+
+// Like Perf_Start(...) but returns -1 rather than exiting when the counter
+// can't be opened, e.g. hardware cache events inside a virtual machine.
+int Perf_Try_Start(const U64 type, const U64 config);
+
 #endif // _PERF_H
@@ -17,6 +17,9 @@
 */
 
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <linux/perf_event.h>
 #include <assert.h>
 
@@ -28,78 +31,300 @@
 #include "perf.h"
 #include "trace.h"
 
-Trace_Run_Result
-Trace_Run(Trace trace, U64 perf_type, U64 perf_config)
+// An allocation the allocator couldn't serve isn't live, the replay carries on
+// without it and reports how many there were at the end.
+static bool
+Trace_Check_Alloc(const void *ptr, const size_t size, size_t *failed)
 {
-    Heap_Sim_Brk();
+    if (!ptr && size > 0)
+    {
+        *failed += 1;
+        return false;
+    }
+    return true;
+}
 
-    if (!M_Init())
+// Push the cost of an op, what every counter went up by, each divided by the
+// number of objects the op handled.
+static void
+Trace_Push_Costs(Vec_U64 **vecs, const size_t num_events, const U64 *start, const U64 *end, const size_t objects)
+{
+    for (size_t k = 0; k < num_events; k += 1)
     {
-        fprintf(stderr, "M_Init failed\n");
-        exit(1);
+        Vec_U64_Push(vecs[k], (end[k] - start[k]) / objects);
     }
+}
 
+// What the threads replaying one trace at once share.
+typedef struct Trace_Replay
+{
+    const M_Allocator *allocator;
+    M_Context *ctx;
+    Heap_Sim *heap;
+    Trace trace;
+    const Perf_Event *events;
+    size_t num_events;
+    // bytes live in all the threads together, the most there ever were, and
+    // the biggest the heap and mappings were after any op...
+    atomic_ullong live;
+    atomic_ullong max_live;
+    atomic_ullong max_heap;
+    atomic_size_t failed;
+} Trace_Replay;
+
+// One thread of a replay, with the ids it allocated and the costs of the ops
+// it ran.
+typedef struct Trace_Thread
+{
+    Trace_Replay *replay;
     void **alloc_ptrs;
     size_t *alloc_sizes;
-    U8 *_ = malloc(trace.num_ids * sizeof(*alloc_ptrs) + trace.num_ids * sizeof(*alloc_sizes));
+    Trace_Costs costs[PERF_GROUP_MAX];
+    // the vectors every counter's cost of each type of op goes to...
+    Vec_U64 *vecs[FREE_BATCH + 1][PERF_GROUP_MAX];
+} Trace_Thread;
+
+// Aligned allocations are counted as mallocs and sized frees as frees.
+static const size_t column_of[] = {
+    [ALLOC] = ALLOC,
+    [FREE] = FREE,
+    [REALLOC] = REALLOC,
+    [CALLOC] = CALLOC,
+    [ALLOC_BATCH] = ALLOC_BATCH,
+    [FREE_BATCH] = FREE_BATCH,
+    [ALIGNED_ALLOC] = ALLOC,
+    [MEMALIGN] = ALLOC,
+    [FREE_SIZED] = FREE,
+};
+
+// Raise the max to value if it's bigger.
+static void
+Trace_Atomic_Max(atomic_ullong *max, const U64 value)
+{
+    U64 old = atomic_load_explicit(max, memory_order_relaxed);
+    while (old < value && !atomic_compare_exchange_weak_explicit(max, &old, value, memory_order_relaxed,
+                                                                 memory_order_relaxed))
+    {
+    }
+}
+
+// Make room for every op of the thread up front and touch it, so the page
+// faults of the replay are the allocator's and not the harness's own.
+static void
+Trace_Thread_Prepare(Trace_Thread *thread, Trace_Replay *replay)
+{
+    const Trace trace = replay->trace;
+    const size_t num_events = replay->num_events;
+
+    thread->replay = replay;
+    U8 *_ = calloc(trace.num_ids, sizeof(*thread->alloc_ptrs) + sizeof(*thread->alloc_sizes));
     if (!_)
     {
-        fprintf(stderr, "malloc failed\n");
+        fprintf(stderr, "calloc failed\n");
         exit(1);
     }
-    alloc_ptrs = (void **)_;
-    alloc_sizes = (size_t *)(_ + trace.num_ids * sizeof(*alloc_ptrs));
+    thread->alloc_ptrs = (void **)_;
+    thread->alloc_sizes = (size_t *)(_ + trace.num_ids * sizeof(*thread->alloc_ptrs));
+
+    Trace_Costs *costs = thread->costs;
+    for (size_t k = 0; k < num_events; k += 1)
+    {
+        thread->vecs[ALLOC][k] = &costs[k].malloc_cyc;
+        thread->vecs[FREE][k] = &costs[k].free_cyc;
+        thread->vecs[REALLOC][k] = &costs[k].realloc_cyc;
+        thread->vecs[CALLOC][k] = &costs[k].calloc_cyc;
+        thread->vecs[ALLOC_BATCH][k] = &costs[k].malloc_batch_cyc;
+        thread->vecs[FREE_BATCH][k] = &costs[k].free_batch_cyc;
+    }
+
+    size_t num_ops_of[FREE_BATCH + 1] = { 0 };
+    for (size_t i = 0; i < trace.num_ops; i += 1)
+    {
+        num_ops_of[column_of[trace.ops[i].type]] += 1;
+    }
+    for (size_t t = 0; t <= FREE_BATCH; t += 1)
+    {
+        for (size_t k = 0; k < num_events; k += 1)
+        {
+            Vec_U64 *vec = thread->vecs[t][k];
+            Vec_U64_Reserve(vec, MAX(num_ops_of[t], 1));
+            memset(vec->data, 0, vec->cap * sizeof(*vec->data));
+        }
+    }
+    memset(_, 0, trace.num_ids * (sizeof(*thread->alloc_ptrs) + sizeof(*thread->alloc_sizes)));
+}
 
-    Vec_U64 malloc_cyc = { 0 };
-    Vec_U64 realloc_cyc = { 0 };
-    Vec_U64 free_cyc = { 0 };
+// Replay the whole trace once on the calling thread, with ids of its own.
+static void *
+Trace_Replay_Thread(void *arg)
+{
+    Trace_Thread *thread = arg;
+    Trace_Replay *replay = thread->replay;
+    const M_Allocator *allocator = replay->allocator;
+    M_Context *ctx = replay->ctx;
+    Heap_Sim *heap = replay->heap;
+    const Trace trace = replay->trace;
+    const Perf_Event *events = replay->events;
+    const size_t num_events = replay->num_events;
+    void **alloc_ptrs = thread->alloc_ptrs;
+    size_t *alloc_sizes = thread->alloc_sizes;
+    Vec_U64 *(*vecs)[PERF_GROUP_MAX] = thread->vecs;
+    Trace_Costs *costs = thread->costs;
 
+    // bytes live in this thread, and what it last added to the shared count...
     U64 total_alloc_size = 0;
-    U64 max_alloc_size = 0;
-    U64 max_heap_size = Heap_Sim_Get_Heap_Size();
+    U64 shared_alloc_size = 0;
+    size_t failed = 0;
+
+    // one group of counters for the whole replay, read before and after
+    // every op...
+    Perf_Group group = Perf_Group_Open(events, num_events);
+    U64 start[PERF_GROUP_MAX];
+    U64 end[PERF_GROUP_MAX];
 
     for (size_t i = 0; i < trace.num_ops; i += 1)
     {
         size_t id = trace.ops[i].id;
         size_t size = trace.ops[i].size;
+        size_t objects = 1;
 
         switch (trace.ops[i].type)
         {
         case ALLOC:
         {
-            int fd = Perf_Start(perf_type, perf_config);
-            // TODO: check success of malloc, realloc, free...
-            void *ptr = M_malloc(size);
-            U64 cycles = Perf_Stop(fd);
+            Perf_Group_Read(&group, start);
+            void *ptr = allocator->malloc(ctx, size);
+            Perf_Group_Read(&group, end);
+
+            if (!Trace_Check_Alloc(ptr, size, &failed))
+            {
+                size = 0;
+            }
+
+            total_alloc_size += size;
+            alloc_ptrs[id] = ptr;
+            alloc_sizes[id] = size;
+            break;
+        }
+
+        case CALLOC:
+        {
+            Perf_Group_Read(&group, start);
+            void *ptr = allocator->calloc(ctx, 1, size);
+            Perf_Group_Read(&group, end);
+
+            if (!Trace_Check_Alloc(ptr, size, &failed))
+            {
+                size = 0;
+            }
 
             total_alloc_size += size;
             alloc_ptrs[id] = ptr;
             alloc_sizes[id] = size;
-            Vec_U64_Push(&malloc_cyc, cycles);
             break;
         }
 
         case REALLOC:
         {
-            int fd = Perf_Start(perf_type, perf_config);
-            void *ptr = M_realloc(alloc_ptrs[id], size);
-            U64 cycles = Perf_Stop(fd);
+            Perf_Group_Read(&group, start);
+            void *ptr = allocator->realloc(ctx, alloc_ptrs[id], size);
+            Perf_Group_Read(&group, end);
+
+            // a failed realloc leaves the old block as it was...
+            if (!Trace_Check_Alloc(ptr, size, &failed))
+            {
+                break;
+            }
 
             total_alloc_size += size - alloc_sizes[id];
             alloc_ptrs[id] = ptr;
             alloc_sizes[id] = size;
-            Vec_U64_Push(&realloc_cyc, cycles);
             break;
         }
 
         case FREE:
         {
-            int fd = Perf_Start(perf_type, perf_config);
-            M_free(alloc_ptrs[id]);
-            U64 cycles = Perf_Stop(fd);
+            Perf_Group_Read(&group, start);
+            allocator->free(ctx, alloc_ptrs[id]);
+            Perf_Group_Read(&group, end);
 
             total_alloc_size -= alloc_sizes[id];
-            Vec_U64_Push(&free_cyc, cycles);
+            break;
+        }
+
+        case ALIGNED_ALLOC:
+        case MEMALIGN:
+        {
+            const size_t alignment = trace.ops[i].alignment;
+
+            Perf_Group_Read(&group, start);
+            void *ptr = trace.ops[i].type == ALIGNED_ALLOC ? allocator->aligned_alloc(ctx, alignment, size)
+                                                           : allocator->memalign(ctx, alignment, size);
+            Perf_Group_Read(&group, end);
+
+            if (!Trace_Check_Alloc(ptr, size, &failed))
+            {
+                size = 0;
+            }
+            assert((uintptr_t)ptr % alignment == 0);
+
+            total_alloc_size += size;
+            alloc_ptrs[id] = ptr;
+            alloc_sizes[id] = size;
+            break;
+        }
+
+        case FREE_SIZED:
+        {
+            // the size is the one the block was last allocated or reallocated
+            // with, which it has to hold at least...
+            assert(allocator->malloc_usable_size(ctx, alloc_ptrs[id]) >= alloc_sizes[id]);
+
+            Perf_Group_Read(&group, start);
+            allocator->free_sized(ctx, alloc_ptrs[id], alloc_sizes[id]);
+            Perf_Group_Read(&group, end);
+
+            total_alloc_size -= alloc_sizes[id];
+            break;
+        }
+
+        case ALLOC_BATCH:
+        {
+            size_t count = trace.ops[i].count;
+
+            Perf_Group_Read(&group, start);
+            const size_t allocated = allocator->malloc_batch(ctx, size, count, &alloc_ptrs[id]);
+            Perf_Group_Read(&group, end);
+
+            for (size_t k = 0; k < count; k += 1)
+            {
+                if (k >= allocated)
+                {
+                    alloc_ptrs[id + k] = NULL;
+                }
+                alloc_sizes[id + k] = k < allocated ? size : 0;
+            }
+            failed += count - allocated;
+            total_alloc_size += size * allocated;
+            objects = count;
+            break;
+        }
+
+        case FREE_BATCH:
+        {
+            size_t count = trace.ops[i].count;
+
+            // M_free_batch sorts the pointers, the ids are dead after this
+            // anyway...
+            Perf_Group_Read(&group, start);
+            allocator->free_batch(ctx, &alloc_ptrs[id], count);
+            Perf_Group_Read(&group, end);
+
+            for (size_t k = 0; k < count; k += 1)
+            {
+                total_alloc_size -= alloc_sizes[id + k];
+            }
+            objects = count;
             break;
         }
         default:
@@ -108,18 +333,144 @@ Trace_Run(Trace trace, U64 perf_type, U64 perf_config)
         }
         }
 
-        max_alloc_size = MAX(max_alloc_size, total_alloc_size);
-        max_heap_size = MAX(max_heap_size, Heap_Sim_Get_Heap_Size());
+        Trace_Push_Costs(vecs[column_of[trace.ops[i].type]], num_events, start, end, objects);
+
+        // the difference wraps around when it's negative, which the sum
+        // undoes...
+        const U64 delta = total_alloc_size - shared_alloc_size;
+        const U64 live = atomic_fetch_add_explicit(&replay->live, delta, memory_order_relaxed) + delta;
+        shared_alloc_size = total_alloc_size;
+        Trace_Atomic_Max(&replay->max_live, live);
+        Trace_Atomic_Max(&replay->max_heap, Heap_Sim_Get_Heap_Size(heap) + Heap_Sim_Get_Mapped_Size(heap));
     }
 
-    assert(malloc_cyc.len + realloc_cyc.len + free_cyc.len == trace.num_ops);
+    Perf_Group_Close(&group);
 
-    free(_);
+    for (size_t k = 0; k < num_events; k += 1)
+    {
+        const Trace_Costs *c = &costs[k];
+        assert(c->malloc_cyc.len + c->calloc_cyc.len + c->realloc_cyc.len + c->free_cyc.len +
+                   c->malloc_batch_cyc.len + c->free_batch_cyc.len ==
+               trace.num_ops);
+    }
+
+    atomic_fetch_add_explicit(&replay->failed, failed, memory_order_relaxed);
+
+    free(alloc_ptrs);
+    return NULL;
+}
+
+Trace_Run_Result
+Trace_Run(const M_Allocator *allocator, M_Context *ctx, Heap_Sim *heap, Trace trace, const Perf_Event *events,
+          size_t num_events, size_t threads)
+{
+    assert(num_events <= PERF_GROUP_MAX);
+    assert(threads >= 1);
 
-    return (Trace_Run_Result){
-        .malloc_cyc = malloc_cyc,
-        .realloc_cyc = realloc_cyc,
-        .free_cyc = free_cyc,
-        .util = (double)max_alloc_size / (double)max_heap_size,
+    Heap_Sim_Brk(heap);
+
+    if (!allocator->init(ctx, heap))
+    {
+        fprintf(stderr, "M_Init failed\n");
+        exit(1);
+    }
+
+    Trace_Replay replay = {
+        .allocator = allocator,
+        .ctx = ctx,
+        .heap = heap,
+        .trace = trace,
+        .events = events,
+        .num_events = num_events,
     };
+    atomic_init(&replay.live, 0);
+    atomic_init(&replay.max_live, 0);
+    atomic_init(&replay.max_heap, Heap_Sim_Get_Heap_Size(heap) + Heap_Sim_Get_Mapped_Size(heap));
+    atomic_init(&replay.failed, 0);
+
+    Trace_Thread *replay_threads = calloc(threads, sizeof(*replay_threads));
+    pthread_t *workers = calloc(threads, sizeof(*workers));
+    if (!replay_threads || !workers)
+    {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+
+    for (size_t t = 0; t < threads; t += 1)
+    {
+        Trace_Thread_Prepare(&replay_threads[t], &replay);
+    }
+
+    // the counters are inherited by the threads started after them...
+    const int page_faults_fd = Perf_Try_Start(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    const int tlb_misses_fd =
+        Perf_Try_Start(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    // the calling thread replays the trace as well, the others at the same
+    // time on the same heap...
+    for (size_t t = 1; t < threads; t += 1)
+    {
+        if (pthread_create(&workers[t], NULL, Trace_Replay_Thread, &replay_threads[t]) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    Trace_Replay_Thread(&replay_threads[0]);
+    for (size_t t = 1; t < threads; t += 1)
+    {
+        pthread_join(workers[t], NULL);
+    }
+
+    const U64 page_faults = page_faults_fd == -1 ? 0 : Perf_Stop(page_faults_fd);
+    const U64 tlb_misses = tlb_misses_fd == -1 ? 0 : Perf_Stop(tlb_misses_fd);
+
+    const size_t failed = atomic_load(&replay.failed);
+    if (failed > 0)
+    {
+        fprintf(stderr, "%s couldn't allocate %zu objects, they aren't counted as live\n", allocator->name, failed);
+    }
+
+    Trace_Run_Result result = {
+        .util = (double)atomic_load(&replay.max_live) / (double)atomic_load(&replay.max_heap),
+        .reclaimed = Heap_Sim_Get_Reclaimed_Size(heap),
+        .sbrk_calls = Heap_Sim_Get_Sbrk_Count(heap),
+        .heap_grows = Heap_Sim_Get_Grow_Count(heap),
+        .page_faults = page_faults,
+        .tlb_misses = tlb_misses,
+    };
+
+    // the costs of all the threads are pooled...
+    memcpy(result.costs, replay_threads[0].costs, sizeof(result.costs));
+    for (size_t t = 1; t < threads; t += 1)
+    {
+        for (size_t k = 0; k < num_events; k += 1)
+        {
+            Trace_Costs *c = &result.costs[k];
+            const Trace_Costs *other = &replay_threads[t].costs[k];
+            Vec_U64_Append(&c->malloc_cyc, other->malloc_cyc);
+            Vec_U64_Append(&c->calloc_cyc, other->calloc_cyc);
+            Vec_U64_Append(&c->realloc_cyc, other->realloc_cyc);
+            Vec_U64_Append(&c->free_cyc, other->free_cyc);
+            Vec_U64_Append(&c->malloc_batch_cyc, other->malloc_batch_cyc);
+            Vec_U64_Append(&c->free_batch_cyc, other->free_batch_cyc);
+            Trace_Costs_Release(*other);
+        }
+    }
+
+    free(workers);
+    free(replay_threads);
+    return result;
+}
+
+void
+Trace_Costs_Release(Trace_Costs costs)
+{
+    Vec_U64_Release(costs.malloc_cyc);
+    Vec_U64_Release(costs.calloc_cyc);
+    Vec_U64_Release(costs.realloc_cyc);
+    Vec_U64_Release(costs.free_cyc);
+    Vec_U64_Release(costs.malloc_batch_cyc);
+    Vec_U64_Release(costs.free_batch_cyc);
 }
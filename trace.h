@@ -21,6 +21,8 @@
 
 #include "defines.h"
 #include "vec_u64.h"
+#include "mm.h"
+#include "perf.h"
 
 typedef struct Trace_Op
 {
@@ -28,10 +30,20 @@ typedef struct Trace_Op
     {
         ALLOC,
         FREE,
-        REALLOC
+        REALLOC,
+        CALLOC,
+        ALLOC_BATCH,
+        FREE_BATCH,
+        ALIGNED_ALLOC,
+        MEMALIGN,
+        FREE_SIZED
     } type;
     size_t id;
     size_t size;
+    // ops on a batch take the count ids starting at id, the others just one...
+    size_t count;
+    // what aligned allocations are aligned to, 0 for the others...
+    size_t alignment;
 } Trace_Op;
 
 typedef struct Trace
@@ -42,14 +54,41 @@ typedef struct Trace
     Trace_Op *ops;
 } Trace;
 
-typedef struct Trace_Run_Result
+// Cost of every op of a replay against one counter.
+typedef struct Trace_Costs
 {
     Vec_U64 malloc_cyc;
+    Vec_U64 calloc_cyc;
     Vec_U64 realloc_cyc;
     Vec_U64 free_cyc;
+    // cost of batches divided by the number of objects in them...
+    Vec_U64 malloc_batch_cyc;
+    Vec_U64 free_batch_cyc;
+} Trace_Costs;
+
+typedef struct Trace_Run_Result
+{
+    // one for every event counted, in the order they were given...
+    Trace_Costs costs[PERF_GROUP_MAX];
     F64 util;
+    // bytes of resident memory the allocator gave back to the OS...
+    U64 reclaimed;
+    // calls to Heap_Sim_Sbrk(...) and the ones that raised the heap...
+    U64 sbrk_calls;
+    U64 heap_grows;
+    // page faults and dTLB load misses over the whole replay, 0 when the
+    // counter isn't supported...
+    U64 page_faults;
+    U64 tlb_misses;
 } Trace_Run_Result;
 
-Trace_Run_Result Trace_Run(Trace, U64 perf_type, U64 perf_config);
+// Replay the trace against the allocator on a fresh heap, with a context the
+// allocator created, in threads threads at once that each replay all of it with
+// ids of their own, the allocator has to be thread safe for more than one. The costs of all of them are pooled, and
+// utilization is the most bytes they had live together against the biggest
+// the heap was.
+Trace_Run_Result Trace_Run(const M_Allocator *allocator, M_Context *ctx, Heap_Sim *heap, Trace,
+                           const Perf_Event *events, size_t num_events, size_t threads);
+void Trace_Costs_Release(Trace_Costs costs);
 
 #endif // _TRACE_H
@@ -73,7 +73,23 @@ Trace_Parse_Alloc(String_View input, size_t *index)
     size_t size = Trace_Parse_U64(input, index);
     Trace_Parse_Skip_Whitespace(input, index);
 
-    return (Trace_Op){ ALLOC, id, size };
+    return (Trace_Op){ ALLOC, id, size, 1, 0 };
+}
+
+static Trace_Op
+Trace_Parse_Calloc(String_View input, size_t *index)
+{
+    Char8 c = Trace_Parse_Char(input, index);
+    assert(c == 'c');
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t id = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t size = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    return (Trace_Op){ CALLOC, id, size, 1, 0 };
 }
 
 static Trace_Op
@@ -89,7 +105,7 @@ Trace_Parse_Realloc(String_View input, size_t *index)
     size_t size = Trace_Parse_U64(input, index);
     Trace_Parse_Skip_Whitespace(input, index);
 
-    return (Trace_Op){ REALLOC, id, size };
+    return (Trace_Op){ REALLOC, id, size, 1, 0 };
 }
 
 static Trace_Op
@@ -102,7 +118,76 @@ Trace_Parse_Free(String_View input, size_t *index)
     size_t id = Trace_Parse_U64(input, index);
     Trace_Parse_Skip_Whitespace(input, index);
 
-    return (Trace_Op){ FREE, id, 0 };
+    return (Trace_Op){ FREE, id, 0, 1, 0 };
+}
+
+static Trace_Op
+Trace_Parse_Alloc_Batch(String_View input, size_t *index)
+{
+    Char8 c = Trace_Parse_Char(input, index);
+    assert(c == 'A');
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t id = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t count = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+    assert(count > 0);
+
+    size_t size = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    return (Trace_Op){ ALLOC_BATCH, id, size, count, 0 };
+}
+
+static Trace_Op
+Trace_Parse_Free_Batch(String_View input, size_t *index)
+{
+    Char8 c = Trace_Parse_Char(input, index);
+    assert(c == 'F');
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t id = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t count = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+    assert(count > 0);
+
+    return (Trace_Op){ FREE_BATCH, id, 0, count, 0 };
+}
+
+static Trace_Op
+Trace_Parse_Aligned_Alloc(String_View input, size_t *index)
+{
+    Char8 c = Trace_Parse_Char(input, index);
+    assert(c == 'l' || c == 'm');
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t id = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t alignment = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t size = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    return (Trace_Op){ c == 'l' ? ALIGNED_ALLOC : MEMALIGN, id, size, 1, alignment };
+}
+
+static Trace_Op
+Trace_Parse_Free_Sized(String_View input, size_t *index)
+{
+    Char8 c = Trace_Parse_Char(input, index);
+    assert(c == 's');
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    size_t id = Trace_Parse_U64(input, index);
+    Trace_Parse_Skip_Whitespace(input, index);
+
+    return (Trace_Op){ FREE_SIZED, id, 0, 1, 0 };
 }
 
 Trace
@@ -140,6 +225,13 @@ Trace_Parse(String_View input)
             break;
         }
 
+        case 'c':
+        {
+            ops[op_index] = Trace_Parse_Calloc(input, &index);
+            max_id = MAX(ops[op_index].id, max_id);
+            break;
+        }
+
         case 'r':
         {
             ops[op_index] = Trace_Parse_Realloc(input, &index);
@@ -154,6 +246,35 @@ Trace_Parse(String_View input)
             break;
         }
 
+        case 'A':
+        {
+            ops[op_index] = Trace_Parse_Alloc_Batch(input, &index);
+            max_id = MAX(ops[op_index].id + ops[op_index].count - 1, max_id);
+            break;
+        }
+
+        case 'F':
+        {
+            ops[op_index] = Trace_Parse_Free_Batch(input, &index);
+            max_id = MAX(ops[op_index].id + ops[op_index].count - 1, max_id);
+            break;
+        }
+
+        case 'l':
+        case 'm':
+        {
+            ops[op_index] = Trace_Parse_Aligned_Alloc(input, &index);
+            max_id = MAX(ops[op_index].id, max_id);
+            break;
+        }
+
+        case 's':
+        {
+            ops[op_index] = Trace_Parse_Free_Sized(input, &index);
+            max_id = MAX(ops[op_index].id, max_id);
+            break;
+        }
+
         default:
         {
             assert(false && "Unknown trace operation");
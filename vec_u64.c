@@ -94,7 +94,7 @@ Vec_U64_Stats(Vec_U64 vec)
     {
         sum += vec.data[i];
     }
-    double mean = sum / vec.len;
+    double mean = (double)sum / (double)vec.len;
 
     double variance = 0;
     for (size_t i = 0; i < vec.len; i += 1)